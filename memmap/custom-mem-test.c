@@ -1,98 +1,1023 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
-
-// gcc -o custom-mem-test custom-mem-test.c && sudo ./custom-mem-test && dmesg
-
-/* IOCTL number for use between the kernel and the user space application.
-   _IOR  --- For reading from device to user space app,
-   _IOW  --- Write data passed from user space app to device(Hardware) and
-   _IOWR --- For both read/write data from/to device.
-   */
-
-#define DEV_MEM_ALLOC (0)
-#define DEV_MEM_FREE (1)
-
-#define DEVICE_MEM "/dev/custom_mem_drv"
-
-static int fd;
-#define PROT_READ	0x1     /* Page can be read.  */
-#define PROT_WRITE	0x2     /* Page can be written.  */
-#define PROT_EXEC	0x4     /* Page can be executed.  */
-#define PROT_NONE	0x0     /* Page can not be accessed.  */
-
-#define MAP_SHARED	0x01    /* Share changes.  */
-#define MAP_PRIVATE	0x02    /* Changes are private.  */
-
-#define PAGE_SIZE 4096
-
-int init_memory(void)
-{
-    fd = open(DEVICE_MEM, O_RDWR);
-    if (!fd)
-    {
-        printf("Error opening file.");
-        return -1;
-    }
-
-    printf("(test) device %s opened!\n", DEVICE_MEM);
-    return 0;
-}
-
-
-void* alloc_memory(int size)
-{
-    printf("(test) alloc_memory!\n");
-    void*  p = (void*)0x42424000;
-    ioctl(fd, DEV_MEM_ALLOC, (int32_t*)&size);
-
-    mmap(p, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-
-    printf("(test) Memory allocated! size = %d - %p\n", PAGE_SIZE, p);
-
-    return p;
-}
-
-
-
-void free_memory(void* p)
-{
-    ioctl(fd, DEV_MEM_FREE, (int32_t*)p);
-
-    printf("(test) Memory released!\n");
-
-}
-
-void release_memory(void)
-{
-    close(fd);
-
-    printf("(test) device closed!\n");
-}
-
-int main()
-{
-    int i;
-    void* p = 0;
-
-    if (init_memory() == 0)
-    {
-        p =  alloc_memory(PAGE_SIZE);
-        if (p)
-        {
-            printf("(test) str = %s\n", (char*)p);
-            memset(p, 0, PAGE_SIZE);
-            strcpy(p, "Hello to you too!");
-            free_memory(p);
-        }
-
-        release_memory();
-    }
-
-    return 0;
-}
-
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <linux/dma-buf.h>
+
+#include "custom-mem.h"
+
+// gcc -O2 -I. -o custom-mem-test custom-mem-test.c && sudo ./custom-mem-test && dmesg
+
+/* IOCTL number for use between the kernel and the user space application.
+   _IOR  --- For reading from device to user space app,
+   _IOW  --- Write data passed from user space app to device(Hardware) and
+   _IOWR --- For both read/write data from/to device.
+   */
+
+#define PAGE_SIZE 4096
+#define HUGE_SIZE (2 * 1024 * 1024)
+#define BUFFERS 4
+#define LAZY_SIZE (256 * 1024 * 1024)
+#define BANDWIDTH_SIZE (16 * 1024 * 1024)
+#define BANDWIDTH_RUNS 3
+
+static int fd;
+
+struct buffer
+{
+    struct custom_mem_alloc alloc;
+    void* p;
+};
+
+int init_memory(void)
+{
+    fd = open(CUSTOM_MEM_DEVICE, O_RDWR);
+    if (fd < 0)
+    {
+        printf("Error opening file.");
+        return -1;
+    }
+
+    printf("(test) device %s opened!\n", CUSTOM_MEM_DEVICE);
+    return 0;
+}
+
+
+//Every buffer gets a handle, and its mmap() offset picks it out of the fd
+int alloc_memory(struct buffer* b, size_t size, unsigned int flags)
+{
+    printf("(test) alloc_memory!\n");
+
+    memset(&b->alloc, 0, sizeof(b->alloc));
+    b->alloc.size = size;
+    b->alloc.flags = flags;
+    b->alloc.node = CUSTOM_MEM_NODE_LOCAL;
+    if (ioctl(fd, DEV_MEM_ALLOC, &b->alloc))
+    {
+        perror("(test) DEV_MEM_ALLOC");
+        return -1;
+    }
+
+    b->p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, b->alloc.offset);
+    if (b->p == MAP_FAILED)
+    {
+        perror("(test) mmap");
+        return -1;
+    }
+
+    printf("(test) Memory allocated! size = %zu handle = %llu node = %d - %p\n", size,
+            (unsigned long long)b->alloc.handle, b->alloc.node, b->p);
+
+    return 0;
+}
+
+
+void free_memory(struct buffer* b, size_t size)
+{
+    munmap(b->p, size);
+    if (ioctl(fd, DEV_MEM_FREE, &b->alloc.handle))
+    {
+        perror("(test) DEV_MEM_FREE");
+    }
+
+    printf("(test) Memory released!\n");
+}
+
+/*
+   Two 2 MiB chunks.  Every page gets written through the mapping and must
+   read back, and a mapping of the second chunk alone has to land on it.
+   Without free huge pages the allocation fails, which is not an error of
+   the driver.
+   */
+int test_huge(void)
+{
+    struct buffer h;
+    struct custom_mem_alloc big = { .size = 1, .flags = CUSTOM_MEM_HUGE_1G };
+    size_t i, size = 2 * HUGE_SIZE;
+    char* second;
+    int failed = 0;
+
+    if (ioctl(fd, DEV_MEM_ALLOC, &big) == 0)
+    {
+        printf("(test) CUSTOM_MEM_HUGE_1G should not be supported\n");
+        failed = 1;
+    }
+
+    if (alloc_memory(&h, HUGE_SIZE + 1, CUSTOM_MEM_HUGE_2M))
+    {
+        printf("(test) no huge pages, skipped\n");
+        return failed;
+    }
+
+    if (h.alloc.size != size)
+    {
+        printf("(test) huge buffer rounded to %llu\n", (unsigned long long)h.alloc.size);
+        failed = 1;
+    }
+
+    //Mapped HUGE_SIZE + 1 bytes, remap the whole of it
+    munmap(h.p, HUGE_SIZE + 1);
+    h.p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, h.alloc.offset);
+    if (h.p == MAP_FAILED)
+    {
+        perror("(test) mmap huge");
+        return 1;
+    }
+    printf("(test) huge buffer at %p, %s\n", h.p, ((uintptr_t)h.p & (HUGE_SIZE - 1)) ? "unaligned" : "aligned");
+
+    for (i = 0; i < size; i += PAGE_SIZE)
+    {
+        *(size_t*)((char*)h.p + i) = i;
+    }
+    for (i = 0; i < size; i += PAGE_SIZE)
+    {
+        if (*(size_t*)((char*)h.p + i) != i)
+        {
+            printf("(test) huge buffer offset %zu reads %zu\n", i, *(size_t*)((char*)h.p + i));
+            failed = 1;
+            break;
+        }
+    }
+
+    second = mmap(NULL, HUGE_SIZE, PROT_READ, MAP_SHARED, fd, h.alloc.offset + HUGE_SIZE);
+    if (second == MAP_FAILED)
+    {
+        perror("(test) mmap second chunk");
+        failed = 1;
+    }
+    else
+    {
+        if (*(size_t*)(second + PAGE_SIZE) != HUGE_SIZE + PAGE_SIZE)
+        {
+            printf("(test) second chunk mapped the wrong memory\n");
+            failed = 1;
+        }
+        munmap(second, HUGE_SIZE);
+    }
+
+    //An aligned address over an offset that is not must still map page by page
+    second = mmap(NULL, 2 * HUGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (second != MAP_FAILED)
+    {
+        char* fixed = (char*)(((uintptr_t)second + HUGE_SIZE - 1) & ~(uintptr_t)(HUGE_SIZE - 1));
+
+        if (mmap(fixed, HUGE_SIZE, PROT_READ, MAP_SHARED | MAP_FIXED, fd, h.alloc.offset + PAGE_SIZE) == fixed)
+        {
+            for (i = 0; i < HUGE_SIZE; i += PAGE_SIZE)
+            {
+                if (*(size_t*)(fixed + i) != PAGE_SIZE + i)
+                {
+                    printf("(test) misaligned mapping offset %zu reads %zu\n", i, *(size_t*)(fixed + i));
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+        else
+        {
+            perror("(test) mmap misaligned");
+            failed = 1;
+        }
+        munmap(second, 2 * HUGE_SIZE);
+    }
+
+    free_memory(&h, size);
+
+    return failed;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+//Writes a word into every page, returns the time it took
+static double touch(char* p, size_t size)
+{
+    double t = now_ms();
+    size_t i;
+
+    for (i = 0; i < size; i += PAGE_SIZE)
+    {
+        *(size_t*)(p + i) = i;
+    }
+    return now_ms() - t;
+}
+
+/*
+   A buffer far bigger than kmalloc() could hand out.  mmap() must not
+   depend on its size, the first pass pays for the faults, and after
+   DEV_MEM_PREFAULT on a fresh mapping the first pass must not.
+   */
+int test_lazy(void)
+{
+    struct buffer l;
+    struct custom_mem_range range;
+    double t, cold, prefaulted;
+    size_t i;
+    int failed = 0;
+
+    t = now_ms();
+    if (alloc_memory(&l, LAZY_SIZE, 0))
+    {
+        return 1;
+    }
+    printf("(test) %d MiB allocated and mapped in %.1f ms\n", LAZY_SIZE >> 20, now_ms() - t);
+
+    cold = touch(l.p, LAZY_SIZE);
+    for (i = 0; i < LAZY_SIZE; i += PAGE_SIZE)
+    {
+        if (*(size_t*)((char*)l.p + i) != i)
+        {
+            printf("(test) lazy buffer offset %zu reads %zu\n", i, *(size_t*)((char*)l.p + i));
+            failed = 1;
+            break;
+        }
+    }
+    munmap(l.p, LAZY_SIZE);
+
+    l.p = mmap(NULL, LAZY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, l.alloc.offset);
+    if (l.p == MAP_FAILED)
+    {
+        perror("(test) mmap lazy");
+        return 1;
+    }
+
+    range.addr = (uintptr_t)l.p;
+    range.length = LAZY_SIZE;
+    t = now_ms();
+    if (ioctl(fd, DEV_MEM_PREFAULT, &range))
+    {
+        perror("(test) DEV_MEM_PREFAULT");
+        failed = 1;
+    }
+    t = now_ms() - t;
+    prefaulted = touch(l.p, LAZY_SIZE);
+
+    printf("(test) first touch %.1f ms, prefault %.1f ms then touch %.1f ms\n", cold, t, prefaulted);
+
+    //Not our mapping
+    range.addr = (uintptr_t)&range;
+    range.length = sizeof(range);
+    if (ioctl(fd, DEV_MEM_PREFAULT, &range) == 0)
+    {
+        printf("(test) prefaulted memory that is not ours\n");
+        failed = 1;
+    }
+
+    free_memory(&l, LAZY_SIZE);
+
+    return failed;
+}
+
+static int node_pages(int node, unsigned long long* pages)
+{
+    struct custom_mem_node_stats st = { .node = node };
+
+    if (ioctl(fd, DEV_MEM_NODE_STATS, &st))
+    {
+        return -1;
+    }
+    *pages = st.pages;
+    printf("(test) node %d: %llu pages held, %llu allocated, %llu remote\n", node,
+            (unsigned long long)st.pages, (unsigned long long)st.allocated, (unsigned long long)st.remote);
+
+    return 0;
+}
+
+/*
+   One buffer per placement policy.  Each must end up where it says it
+   did, and the page counters of that node must account for it.
+   */
+int test_numa(void)
+{
+    static const int policies[] = { 0, CUSTOM_MEM_NODE_LOCAL, CUSTOM_MEM_NODE_INTERLEAVE };
+    struct custom_mem_alloc a;
+    unsigned long long before, after;
+    size_t size = 1024 * PAGE_SIZE;
+    int i, failed = 0;
+
+    for (i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++)
+    {
+        memset(&a, 0, sizeof(a));
+        a.size = size;
+        a.node = policies[i];
+        if (ioctl(fd, DEV_MEM_ALLOC, &a))
+        {
+            perror("(test) DEV_MEM_ALLOC node");
+            failed = 1;
+            continue;
+        }
+        printf("(test) node policy %d got node %d\n", policies[i], a.node);
+
+        if (policies[i] >= 0 && a.node != policies[i])
+        {
+            printf("(test) asked for node %d\n", policies[i]);
+            failed = 1;
+        }
+
+        if (a.node >= 0 && node_pages(a.node, &before) == 0)
+        {
+            if (before < size / PAGE_SIZE)
+            {
+                printf("(test) node %d does not count the buffer\n", a.node);
+                failed = 1;
+            }
+
+            ioctl(fd, DEV_MEM_FREE, &a.handle);
+            if (node_pages(a.node, &after) == 0 && before - after != size / PAGE_SIZE)
+            {
+                printf("(test) node %d freed %llu pages, expected %zu\n", a.node, before - after, size / PAGE_SIZE);
+                failed = 1;
+            }
+        }
+        else
+        {
+            ioctl(fd, DEV_MEM_FREE, &a.handle);
+        }
+    }
+
+    //Nodes that cannot exist
+    memset(&a, 0, sizeof(a));
+    a.size = PAGE_SIZE;
+    a.node = 1 << 20;
+    if (ioctl(fd, DEV_MEM_ALLOC, &a) == 0)
+    {
+        printf("(test) allocated on node %d\n", 1 << 20);
+        failed = 1;
+    }
+
+    return failed;
+}
+
+static void print_pool(const char* when)
+{
+    struct custom_mem_pool_stats st = { .flags = 0 };
+
+    if (ioctl(fd, DEV_MEM_POOL_STATS, &st))
+    {
+        perror("(test) DEV_MEM_POOL_STATS");
+        return;
+    }
+    printf("(test) pool %s: %llu clean %llu dirty of %llu, %llu hits %llu misses %llu refilled %llu recycled\n",
+            when, (unsigned long long)st.clean, (unsigned long long)st.dirty, (unsigned long long)st.target,
+            (unsigned long long)st.hits, (unsigned long long)st.misses, (unsigned long long)st.refilled,
+            (unsigned long long)st.recycled);
+}
+
+/*
+   Freed buffers go back to the pool and come out again for the next
+   allocations, so every round scribbles over its buffer and the next one
+   must still start out zeroed.
+   */
+int test_pool(void)
+{
+    struct buffer p;
+    size_t i, size = 64 * PAGE_SIZE;
+    int round, failed = 0;
+
+    print_pool("before");
+
+    for (round = 0; round < 16 && !failed; round++)
+    {
+        if (alloc_memory(&p, size, 0))
+        {
+            return 1;
+        }
+
+        //The kernel writes its greeting at the start
+        for (i = PAGE_SIZE; i < size; i++)
+        {
+            if (((char*)p.p)[i])
+            {
+                printf("(test) round %d: byte %zu of a new buffer is %d\n", round, i, ((char*)p.p)[i]);
+                failed = 1;
+                break;
+            }
+        }
+
+        memset(p.p, 0xa5, size);
+        free_memory(&p, size);
+
+        //Let the pool thread get to the dirty pages every other round
+        if (round & 1)
+        {
+            usleep(10000);
+        }
+    }
+
+    print_pool("after");
+
+    return failed;
+}
+
+static void pass_write(uint64_t* p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        p[i] = i;
+    }
+}
+
+//Keeps the reads from being optimized away
+volatile uint64_t read_sink;
+
+static void pass_read(uint64_t* p, size_t n)
+{
+    uint64_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        sum += p[i];
+    }
+    read_sink = sum;
+}
+
+static void pass_mixed(uint64_t* p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        p[i] += i;
+    }
+}
+
+//Best of BANDWIDTH_RUNS, in MB/s
+static double bandwidth(void (*pass)(uint64_t*, size_t), void* p, size_t size)
+{
+    double t, best = 0;
+    int run;
+
+    for (run = 0; run < BANDWIDTH_RUNS; run++)
+    {
+        t = now_ms();
+        pass(p, size / sizeof(uint64_t));
+        t = now_ms() - t;
+        if (t > 0 && (best == 0 || t < best))
+        {
+            best = t;
+        }
+    }
+
+    return best > 0 ? size / best / 1e3 : 0;
+}
+
+/*
+   Sequential write, read and read-modify-write over the same buffer size
+   in every cache mode.  Expect WC close to WB for writes and far behind
+   for reads, and UC behind on everything.
+   */
+int test_bandwidth(void)
+{
+    static const struct { unsigned int flags; const char* name; } modes[] =
+    {
+        { CUSTOM_MEM_CACHE_WB, "WB" },
+        { CUSTOM_MEM_CACHE_WC, "WC" },
+        { CUSTOM_MEM_CACHE_UC, "UC" },
+    };
+    struct custom_mem_range range;
+    struct buffer b;
+    int i, failed = 0;
+
+    printf("(test) %d MiB      write MB/s    read MB/s   mixed MB/s\n", BANDWIDTH_SIZE >> 20);
+
+    for (i = 0; i < (int)(sizeof(modes) / sizeof(modes[0])); i++)
+    {
+        if (alloc_memory(&b, BANDWIDTH_SIZE, modes[i].flags))
+        {
+            failed = 1;
+            continue;
+        }
+
+        //Faults are not what we are measuring
+        range.addr = (uintptr_t)b.p;
+        range.length = BANDWIDTH_SIZE;
+        if (ioctl(fd, DEV_MEM_PREFAULT, &range))
+        {
+            perror("(test) DEV_MEM_PREFAULT");
+            failed = 1;
+        }
+
+        printf("(test) %-8s %12.0f %12.0f %12.0f\n", modes[i].name,
+                bandwidth(pass_write, b.p, BANDWIDTH_SIZE),
+                bandwidth(pass_read, b.p, BANDWIDTH_SIZE),
+                bandwidth(pass_mixed, b.p, BANDWIDTH_SIZE));
+
+        free_memory(&b, BANDWIDTH_SIZE);
+    }
+
+    //Only one mode at a time
+    memset(&b.alloc, 0, sizeof(b.alloc));
+    b.alloc.size = PAGE_SIZE;
+    b.alloc.flags = CUSTOM_MEM_CACHE_MASK;
+    if (ioctl(fd, DEV_MEM_ALLOC, &b.alloc) == 0)
+    {
+        printf("(test) took cache mode %x\n", CUSTOM_MEM_CACHE_MASK);
+        failed = 1;
+    }
+
+    return failed;
+}
+
+static int dmabuf_sync(int dfd, __u64 flags)
+{
+    struct dma_buf_sync sync = { .flags = flags };
+
+    return ioctl(dfd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+static int send_fd(int sock, int sfd)
+{
+    char data = 0, control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sfd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sock)
+{
+    char data, control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr* cmsg;
+    int rfd;
+
+    if (recvmsg(sock, &msg, 0) != 1 || !(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        return -1;
+    }
+    memcpy(&rfd, CMSG_DATA(cmsg), sizeof(int));
+
+    return rfd;
+}
+
+/*
+   Exports a buffer and hands the dma-buf to a child over a unix socket.
+   The child maps it and writes into it, and the parent must see that
+   through its own mapping of the buffer without any copy.  The handle is
+   freed before the child is done: the dma-buf keeps the pages.
+   */
+int test_dmabuf(void)
+{
+    struct buffer b;
+    struct custom_mem_export exp;
+    size_t size = 16 * PAGE_SIZE;
+    int sv[2], status, failed = 0;
+    pid_t pid;
+
+    if (alloc_memory(&b, size, 0))
+    {
+        return 1;
+    }
+
+    memset(&exp, 0, sizeof(exp));
+    exp.handle = b.alloc.handle;
+    exp.flags = CUSTOM_MEM_EXPORT_CLOEXEC;
+    if (ioctl(fd, DEV_MEM_EXPORT, &exp))
+    {
+        perror("(test) DEV_MEM_EXPORT");
+        free_memory(&b, size);
+        return 1;
+    }
+    printf("(test) buffer %llu exported as fd %d\n", (unsigned long long)b.alloc.handle, exp.fd);
+
+    sprintf(b.p, "written by the parent");
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    {
+        perror("(test) socketpair");
+        return 1;
+    }
+
+    pid = fork();
+    if (pid == 0)
+    {
+        int dfd;
+        char* p;
+
+        close(sv[0]);
+        dfd = recv_fd(sv[1]);
+        if (dfd < 0)
+        {
+            _exit(1);
+        }
+
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dfd, 0);
+        if (p == MAP_FAILED)
+        {
+            _exit(1);
+        }
+
+        dmabuf_sync(dfd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW);
+        if (strcmp(p, "written by the parent"))
+        {
+            _exit(1);
+        }
+        sprintf(p + size - PAGE_SIZE, "written by the child");
+        dmabuf_sync(dfd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
+
+        _exit(0);
+    }
+
+    close(sv[1]);
+    if (send_fd(sv[0], exp.fd))
+    {
+        perror("(test) sendmsg");
+        failed = 1;
+    }
+    close(sv[0]);
+
+    //Only the mapping and the dma-buf are left holding the pages
+    munmap(b.p, size);
+    if (ioctl(fd, DEV_MEM_FREE, &b.alloc.handle))
+    {
+        perror("(test) DEV_MEM_FREE");
+        failed = 1;
+    }
+
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+    {
+        printf("(test) dma-buf child failed\n");
+        failed = 1;
+    }
+
+    b.p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, exp.fd, 0);
+    if (b.p == MAP_FAILED)
+    {
+        perror("(test) mmap dma-buf");
+        failed = 1;
+    }
+    else
+    {
+        dmabuf_sync(exp.fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+        if (strcmp((char*)b.p + size - PAGE_SIZE, "written by the child"))
+        {
+            printf("(test) the child's write did not arrive\n");
+            failed = 1;
+        }
+        dmabuf_sync(exp.fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+        munmap(b.p, size);
+    }
+
+    close(exp.fd);
+
+    return failed;
+}
+
+static int reg(void* addr, size_t length, struct custom_mem_register* r)
+{
+    memset(r, 0, sizeof(*r));
+    r->addr = (uintptr_t)addr;
+    r->length = length;
+    r->flags = CUSTOM_MEM_REGISTER_WRITE;
+    if (ioctl(fd, DEV_MEM_REGISTER, r))
+    {
+        perror("(test) DEV_MEM_REGISTER");
+        return -1;
+    }
+    printf("(test) registered %p + %zu: handle %llu offset %llu%s\n", addr, length, (unsigned long long)r->handle,
+            (unsigned long long)r->offset, r->cached ? " cached" : "");
+
+    return 0;
+}
+
+/*
+   Registers some of our own memory.  A range inside a registration that
+   is still pinned, in use or not, comes back from the cache; after the
+   memory behind the address changed it must not.
+   */
+int test_register(void)
+{
+    struct custom_mem_register r1, r2, r3;
+    size_t size = 64 * PAGE_SIZE;
+    char* p;
+    int failed = 0;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        perror("(test) mmap anonymous");
+        return 1;
+    }
+    memset(p, 1, size);
+
+    if (reg(p, size, &r1) || reg(p + 3 * PAGE_SIZE + 10, PAGE_SIZE, &r2))
+    {
+        munmap(p, size);
+        return 1;
+    }
+    if (!r2.cached || r2.handle != r1.handle || r2.offset != 3 * PAGE_SIZE + 10)
+    {
+        printf("(test) sub range was not served from the registration\n");
+        failed = 1;
+    }
+
+    //Not a buffer of ours to free or map
+    if (ioctl(fd, DEV_MEM_FREE, &r1.handle) == 0 ||
+        mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, fd, r1.handle << 30) != MAP_FAILED)
+    {
+        printf("(test) registration freed or mapped like a buffer\n");
+        failed = 1;
+    }
+
+    ioctl(fd, DEV_MEM_UNREGISTER, &r2.handle);
+    ioctl(fd, DEV_MEM_UNREGISTER, &r1.handle);
+    if (ioctl(fd, DEV_MEM_UNREGISTER, &r1.handle) == 0)
+    {
+        printf("(test) unregistered once too often\n");
+        failed = 1;
+    }
+
+    //Unused but still pinned
+    if (reg(p, size, &r3) == 0)
+    {
+        if (!r3.cached)
+        {
+            printf("(test) unused registration was not reused\n");
+            failed = 1;
+        }
+        ioctl(fd, DEV_MEM_UNREGISTER, &r3.handle);
+    }
+
+    //New memory at the same address
+    if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != p)
+    {
+        perror("(test) mmap fixed");
+        failed = 1;
+    }
+    else if (reg(p, size, &r3) == 0)
+    {
+        if (r3.cached)
+        {
+            printf("(test) stale registration was reused\n");
+            failed = 1;
+        }
+        ioctl(fd, DEV_MEM_UNREGISTER, &r3.handle);
+    }
+
+    munmap(p, size);
+
+    return failed;
+}
+
+static int get_stats(struct custom_mem_stats* st)
+{
+    if (ioctl(fd, DEV_MEM_STATS, st))
+    {
+        perror("(test) DEV_MEM_STATS");
+        return 1;
+    }
+
+    return 0;
+}
+
+#define SCALING_ITERATIONS 20000
+
+//One worker: its own fd, then alloc + free in a loop once the parent says go
+static int scaling_child(int go)
+{
+    struct custom_mem_alloc a;
+    char c;
+    int cfd, i;
+
+    cfd = open(CUSTOM_MEM_DEVICE, O_RDWR);
+    if (cfd < 0)
+    {
+        return 1;
+    }
+    read(go, &c, 1);
+
+    for (i = 0; i < SCALING_ITERATIONS; i++)
+    {
+        memset(&a, 0, sizeof(a));
+        a.size = 16 * PAGE_SIZE;
+        a.node = CUSTOM_MEM_NODE_LOCAL;
+        if (ioctl(cfd, DEV_MEM_ALLOC, &a) || ioctl(cfd, DEV_MEM_FREE, &a.handle))
+        {
+            close(cfd);
+            return 1;
+        }
+    }
+
+    close(cfd);
+    return 0;
+}
+
+/*
+   1, 2, 4 ... processes allocating and freeing on fds of their own.  With
+   nothing shared but the pools and the page allocator the rate should grow
+   with the process count, up to the number of CPUs.
+   */
+int test_scaling(void)
+{
+    struct custom_mem_stats before, after;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    double t, base = 0;
+    int procs, i, status, go[2], failed = 0;
+
+    if (get_stats(&before))
+    {
+        return 1;
+    }
+
+    for (procs = 1; procs <= cpus && procs <= 16 && !failed; procs *= 2)
+    {
+        if (pipe(go))
+        {
+            perror("(test) pipe");
+            return 1;
+        }
+
+        for (i = 0; i < procs; i++)
+        {
+            if (fork() == 0)
+            {
+                close(go[1]);
+                _exit(scaling_child(go[0]));
+            }
+        }
+        close(go[0]);
+
+        //Give them time to open, then let all of them go at once
+        usleep(100000);
+        t = now_ms();
+        close(go[1]);
+        for (i = 0; i < procs; i++)
+        {
+            if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+            {
+                failed = 1;
+            }
+        }
+        t = now_ms() - t;
+
+        if (procs == 1)
+        {
+            base = SCALING_ITERATIONS / t;
+        }
+        printf("(test) %2d processes: %8.0f alloc+free/s, %.2fx one process\n", procs,
+                procs * SCALING_ITERATIONS / t * 1000, procs * SCALING_ITERATIONS / t / base);
+    }
+
+    if (failed)
+    {
+        printf("(test) a scaling worker failed\n");
+        return 1;
+    }
+
+    if (get_stats(&after))
+    {
+        return 1;
+    }
+    printf("(test) device: %llu opens, %llu open, %llu allocations, %llu frees\n",
+            (unsigned long long)after.opens, (unsigned long long)after.open_files,
+            (unsigned long long)after.allocations, (unsigned long long)after.frees);
+
+    //Every worker allocation counted, whichever CPU it ran on
+    for (procs = 1, i = 0; procs <= cpus && procs <= 16; procs *= 2)
+    {
+        i += procs;
+    }
+    if (after.allocations - before.allocations < (unsigned long long)i * SCALING_ITERATIONS ||
+        after.frees - before.frees < (unsigned long long)i * SCALING_ITERATIONS ||
+        after.opens - before.opens < (unsigned long long)i)
+    {
+        printf("(test) stats missed some of the %d workers\n", i);
+        failed = 1;
+    }
+
+    return failed;
+}
+
+void release_memory(void)
+{
+    close(fd);
+
+    printf("(test) device closed!\n");
+}
+
+int main()
+{
+    struct buffer b[BUFFERS];
+    int i, n, failed = 0;
+
+    if (init_memory() == 0)
+    {
+        for (n = 0; n < BUFFERS; n++)
+        {
+            if (alloc_memory(&b[n], PAGE_SIZE, 0))
+            {
+                failed = 1;
+                break;
+            }
+            printf("(test) str = %s\n", (char*)b[n].p);
+        }
+
+        //Each mapping must land on its own buffer
+        for (i = 0; i < n; i++)
+        {
+            memset(b[i].p, 0, PAGE_SIZE);
+            sprintf(b[i].p, "Hello to you too, buffer %d!", i);
+        }
+        for (i = 0; i < n; i++)
+        {
+            char want[64];
+
+            sprintf(want, "Hello to you too, buffer %d!", i);
+            if (strcmp(b[i].p, want))
+            {
+                printf("(test) buffer %d reads \"%s\"\n", i, (char*)b[i].p);
+                failed = 1;
+            }
+        }
+
+        //Copy-on-write cannot work on these pages
+        if (n && mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, b[0].alloc.offset) != MAP_FAILED)
+        {
+            printf("(test) private mapping of a buffer was allowed\n");
+            failed = 1;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            free_memory(&b[i], PAGE_SIZE);
+        }
+
+        if (test_huge())
+        {
+            failed = 1;
+        }
+
+        if (test_lazy())
+        {
+            failed = 1;
+        }
+
+        if (test_numa())
+        {
+            failed = 1;
+        }
+
+        if (test_pool())
+        {
+            failed = 1;
+        }
+
+        if (test_bandwidth())
+        {
+            failed = 1;
+        }
+
+        if (test_dmabuf())
+        {
+            failed = 1;
+        }
+
+        if (test_register())
+        {
+            failed = 1;
+        }
+
+        if (test_scaling())
+        {
+            failed = 1;
+        }
+
+        //A freed handle is gone
+        if (n && ioctl(fd, DEV_MEM_FREE, &b[0].alloc.handle) == 0)
+        {
+            printf("(test) freed handle %llu twice\n", (unsigned long long)b[0].alloc.handle);
+            failed = 1;
+        }
+
+        release_memory();
+    }
+
+    printf("(test) %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
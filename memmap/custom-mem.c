@@ -1,281 +1,1884 @@
-#include <linux/init.h>
-#include <linux/module.h>
-#include <linux/device.h>
-#include <linux/version.h>
-#include <linux/kernel.h>
-#include <linux/fs.h>
-#include <linux/types.h>
-#include <linux/cdev.h>
-#include <linux/semaphore.h>
-#include <linux/uaccess.h>
-#include <linux/slab.h>
-#include <linux/mm.h>
-
-// make && sudo rmmod custom-mem && sudo insmod custom-mem.ko && sudo dmesg -c
-
-
-#define DEVICE_NAME                     "custom_mem_drv"
-#define CLASS_NAME                      "custom_mem_drv"
-
-#define DEV_MEM_ALLOC                   (0)
-#define DEV_MEM_FREE                    (1)
-
-#define CUSTOM_MEM_PAGE_SHIFT           12
-#define CUSTOM_MEM_PAGE_SIZE            (1UL << CUSTOM_MEM_PAGE_SHIFT)
-#define CUSTOM_MEM_PAGE_MASK            (~(CUSTOM_MEM_PAGE_SIZE-1))
-
-#define CUSTOM_MEM_PAGE_ALIGN(addr)     (((addr)+CUSTOM_MEM_PAGE_SIZE-1)&CUSTOM_MEM_PAGE_MASK)
-#define CUSTOM_MEM_IS_PAGE_ALIGNED(x)   (CUSTOM_MEM_PAGE_ALIGN((uintptr_t) (x)) == (uintptr_t) (x))
-
-#define MIN_ALLOC_SIZE                  4096 //page size
-
-static int      majorNumber;                        ///< Stores the device number -- determined automatically
-static int      numberOpens = 0;                    ///< Counts the number of times the device is opened
-static struct   class*  customcharClass  = NULL;    ///< The device-driver class struct pointer
-static struct   device* customcharDevice = NULL;    ///< The device-driver device struct pointer
-
-static DEFINE_MUTEX(dev_mem_lock);
-
-
-static unsigned long* memAlloc(struct file* fp, size_t size, int node, int type)
-{
-    unsigned long *block_ctrl = NULL;
-    int alloc_size = size * sizeof(unsigned long);
-
-    if (!size || !fp)
-    {
-        printk("(custom_mem) Either size is 0 or FP is 0\n");
-        return (unsigned long*)-1;
-    }
-
-    if (alloc_size < MIN_ALLOC_SIZE)
-    {
-        alloc_size = MIN_ALLOC_SIZE;
-    }
-
-    block_ctrl = kmalloc_node(alloc_size, GFP_KERNEL, node);
-
-    printk("(custom_mem) kmalloc_node() returned %d %d %p\n", alloc_size, node, block_ctrl);
-
-    if ((!block_ctrl) || !CUSTOM_MEM_IS_PAGE_ALIGNED(block_ctrl))
-    {
-        printk("(custom_mem) memAlloc() Unable to allocate memory slab"
-                " or wrong alignment: %p\n", block_ctrl);
-        kfree(block_ctrl);
-        return NULL;
-    }
-
-    memset(block_ctrl, 0, alloc_size);
-    printk("(custom_mem) userMemAlloc() Block ctrl allocated %p \n", block_ctrl);
-
-    return block_ctrl;
-}
-
-
-static int dev_mem_free(struct file *fp, uint32_t cmd, unsigned long arg)
-{
-    unsigned long *mem_info_arg;
-    if (fp == NULL)
-    {
-        printk("(custom_mem) dev_mem_free() Invalid file descriptor\n");
-        return -EIO;
-    }
-
-    mem_info_arg = (long*)arg;
-
-    if (fp->private_data)
-    {
-        printk("(custom_mem) dev_mem_free() %p %s\n", fp->private_data, (char*)fp->private_data);
-        kfree(fp->private_data);
-    }
-
-    return 0;
-}
-
-static int dev_mem_alloc(struct file* fp, uint32_t cmd, unsigned long arg)
-{
-    unsigned long ret = 0;
-    unsigned long requested_size = 0;
-    unsigned long* mem_info = 0;
-    fp->private_data = 0;
-
-    if (fp == NULL)
-    {
-        printk("(custom_mem) dev_mem_alloc() Invalid file descriptor\n");
-        return -EIO;
-    }
-
-    ret = copy_from_user(&requested_size, (unsigned long*)arg, sizeof( unsigned long));
-
-    printk("(custom_mem) dev_mem_alloc() Allocation request size = %ld\n", requested_size);
-    mem_info = memAlloc(fp, requested_size, (int)0, 0);
-
-    if (mem_info)
-    {
-        fp->private_data = mem_info;
-        strcpy((char*)mem_info, "Hello from kernel space");
-        return ret;
-    }
-
-    return -1;
-}
-
-
-static int dev_mmap(struct file *fp, struct vm_area_struct *vma)
-{
-    int ret = 0;
-    unsigned long size;
-    unsigned long phys_kmalloc_area = 0;
-    void *mem_info;
-
-    mem_info = fp->private_data;
-
-    if (!mem_info)
-    {
-        printk("(custom_mem) Mem info not available.\n");
-        return -1;
-    }
-
-    if (vma == 0)
-    {
-        printk("(custom_mem) vmw struct not populated.\n");
-        return -1;
-    }
-
-    size = vma->vm_end - vma->vm_start;
-
-    printk("(custom_mem) vma_start = %03lx vma_end = %03lx size = %ld\n",
-            vma->vm_start, vma->vm_end, size);
-
-    mutex_lock(&dev_mem_lock);
-    phys_kmalloc_area = virt_to_phys(mem_info);
-    mutex_unlock(&dev_mem_lock);
-
-
-    printk("(custom_mem) dev_mmap() phys_kmalloc_area = %03lx virt_kmalloc = %p\n",
-            phys_kmalloc_area, (unsigned long*)mem_info);
-
-    /*
-       What remap_pfn_range does is create another page table entry, with a
-       different virtual address to the same physical memory page that doesn't
-       have that bit set.  Usually, it's a bad idea btw :-)
-       */
-    ret = remap_pfn_range(vma,
-            vma->vm_start,
-            phys_kmalloc_area >> CUSTOM_MEM_PAGE_SHIFT, /*Describing a Page Table Entry (12 bits right shift)*/
-            size,
-            vma->vm_page_prot); //protection flags that are set for each PTE in this VMA"
-    if (unlikely(ret))
-    {
-        printk("(custom_mem) remap_pfn_range failed, ret = %d\n",ret);
-    }
-
-    printk("(custom_mem) remap_pfn_range successful! ret = %d\n", ret);
-
-    return ret;
-}
-
-
-static long dev_ioctl(struct file *fp, uint32_t cmd, unsigned long arg)
-{
-    int ret;
-    printk(KERN_INFO "(custom_mem) dev_ioctl() cmd = %d arg = %ld\n", cmd, arg);
-
-    switch (cmd) {
-        case DEV_MEM_ALLOC:
-            mutex_lock(&dev_mem_lock);
-            ret = dev_mem_alloc(fp, cmd, arg);
-            mutex_unlock(&dev_mem_lock);
-            if(ret > 0) return -ENOMEM;
-            break;
-
-        case DEV_MEM_FREE:
-            mutex_lock(&dev_mem_lock);
-            ret = dev_mem_free(fp, cmd, arg);
-            mutex_unlock(&dev_mem_lock);
-            if(ret> 0) return -EIO;
-            break;
-
-        default:
-            printk("(custom_mem) default IOCTL\n");
-            return 0;
-    }
-
-    return 0;
-}
-
-
-static int dev_open(struct inode *inodep, struct file *filep){
-    numberOpens++;
-    printk("(custom_mem) dev_open(). Device has been opened %d time(s).\n", numberOpens);
-    return 0;
-}
-
-
-static int dev_release(struct inode *inodep, struct file *filep){
-    printk(KERN_INFO "(custom_mem) dev_release()\n");
-    numberOpens = 0;
-    return 0;
-}
-
-
-static struct file_operations fops =
-{
-    owner:THIS_MODULE,
-    mmap:dev_mmap,
-    unlocked_ioctl:dev_ioctl,
-    compat_ioctl:dev_ioctl,
-    open:dev_open,
-    release:dev_release,
-};
-
-static int __init custom_mem_init(void)
-{
-    mutex_init(&dev_mem_lock);
-
-    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
-    if (majorNumber<0)
-    {
-        printk(KERN_ALERT "custom_mem: custom_mem failed to register a major number\n");
-        return majorNumber;
-    }
-    printk("(custom_mem) registered correctly with major number %d\n", majorNumber);
-
-    // Register the device class
-    customcharClass = class_create(THIS_MODULE, CLASS_NAME);
-    if (IS_ERR(customcharClass))                 // Check for error and clean up if there is
-    {
-        unregister_chrdev(majorNumber, DEVICE_NAME);
-        printk(KERN_ALERT "(custom_mem) Failed to register device class\n");
-        return PTR_ERR(customcharClass);          // Correct way to return an error on a pointer
-    }
-    printk("(custom_mem) device class registered correctly\n");
-
-    // Register the device driver
-    customcharDevice = device_create(customcharClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-    if (IS_ERR(customcharDevice))                // Clean up if there is an error
-    {
-        class_destroy(customcharClass);           // Repeated code but the alternative is goto statements
-        unregister_chrdev(majorNumber, DEVICE_NAME);
-        printk(KERN_ALERT "Failed to create the device\n");
-        return PTR_ERR(customcharDevice);
-    }
-    printk("(custom_mem) device class created correctly!\n"); // Made it! device was initialized
-
-    return 0;
-}
-
-static void __exit custom_mem_exit(void) /* Destructor */
-{
-    printk("(custom_mem) exit!\n");
-    device_destroy(customcharClass, MKDEV(majorNumber, 0));     // remove the device
-    class_unregister(customcharClass);                          // unregister the device class
-    class_destroy(customcharClass);                             // remove the device class
-    unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
-}
-
-module_init(custom_mem_init);
-module_exit(custom_mem_exit);
-
-MODULE_LICENSE("GPL");
-
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/types.h>
+#include <linux/cdev.h>
+#include <linux/semaphore.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/xarray.h>
+#include <linux/kref.h>
+#include <linux/huge_mm.h>
+#include <linux/vmalloc.h>
+#include <linux/sched/signal.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/highmem.h>
+#include <linux/kthread.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/file.h>
+#include <linux/mmu_notifier.h>
+#include <linux/sched/mm.h>
+#include <linux/capability.h>
+#include <linux/percpu.h>
+#ifdef CONFIG_X86
+#include <asm/set_memory.h>
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
+
+#include "custom-mem.h"
+
+// make && sudo rmmod custom-mem && sudo insmod custom-mem.ko && sudo dmesg -c
+
+
+#define DEVICE_NAME                     "custom_mem_drv"
+#define CLASS_NAME                      "custom_mem_drv"
+
+#define CUSTOM_MEM_PAGE_SHIFT           12
+#define CUSTOM_MEM_PAGE_SIZE            (1UL << CUSTOM_MEM_PAGE_SHIFT)
+#define CUSTOM_MEM_PAGE_MASK            (~(CUSTOM_MEM_PAGE_SIZE-1))
+
+#define CUSTOM_MEM_PAGE_ALIGN(addr)     (((addr)+CUSTOM_MEM_PAGE_SIZE-1)&CUSTOM_MEM_PAGE_MASK)
+#define CUSTOM_MEM_IS_PAGE_ALIGNED(x)   (CUSTOM_MEM_PAGE_ALIGN((uintptr_t) (x)) == (uintptr_t) (x))
+
+//Pages a fault maps past the one that faulted, when they are in the mapping
+#define CUSTOM_MEM_FAULT_AROUND         16
+
+//0 is never handed out
+#define CUSTOM_MEM_HANDLES              XA_LIMIT(1, INT_MAX)
+
+/*
+   mmap() offset of a buffer: its handle times 1 GiB.  The offset of a page
+   inside its buffer stays congruent to its offset in the mapping modulo any
+   huge page size, which the huge fault path insists on.
+   */
+#define CUSTOM_MEM_HANDLE_SHIFT         30
+#define CUSTOM_MEM_HANDLE_PGSHIFT       (CUSTOM_MEM_HANDLE_SHIFT - CUSTOM_MEM_PAGE_SHIFT)
+
+//CUSTOM_MEM_HUGE_2M chunk size
+#define CUSTOM_MEM_HUGE_ORDER           (PMD_SHIFT - CUSTOM_MEM_PAGE_SHIFT)
+#define CUSTOM_MEM_HUGE_SIZE            (1UL << PMD_SHIFT)
+
+static int      majorNumber;                        ///< Stores the device number -- determined automatically
+static atomic_long_t numberOpens;                   ///< Counts the number of times the device is opened
+static atomic_long_t openFiles;                     ///< Files open right now
+static struct   class*  customcharClass  = NULL;    ///< The device-driver class struct pointer
+static struct   device* customcharDevice = NULL;    ///< The device-driver device struct pointer
+
+/*
+   There is no device wide lock: the buffer table of every fd has its own
+   (the xarray's), registrations theirs, and the pools a spinlock each, so
+   processes with their own fds never wait for each other except in the
+   page allocator.  Counters bumped on every allocation are per CPU.
+   */
+struct custom_mem_cpu_stats
+{
+    unsigned long allocations;
+    unsigned long frees;
+};
+
+static DEFINE_PER_CPU(struct custom_mem_cpu_stats, memStats);
+
+//Page counts, see struct custom_mem_node_stats
+struct custom_mem_node_counters
+{
+    atomic_long_t pages;
+    atomic_long_t allocated;
+    atomic_long_t remote;
+};
+
+static struct custom_mem_node_counters nodeStats[MAX_NUMNODES];
+
+static unsigned int pool_pages = 1024;
+module_param(pool_pages, uint, 0444);
+MODULE_PARM_DESC(pool_pages, "Zeroed pages kept ready per node, 0 turns the page pool off");
+
+static unsigned int pool_huge = 4;
+module_param(pool_huge, uint, 0444);
+MODULE_PARM_DESC(pool_huge, "Zeroed 2 MiB chunks kept ready per node, 0 turns the huge pool off");
+
+static unsigned int reg_cache_pages = 65536;
+module_param(reg_cache_pages, uint, 0444);
+MODULE_PARM_DESC(reg_cache_pages, "Pinned pages per fd that unregistered ranges may keep for reuse");
+
+/*
+   One allocation, shared by the fd's table and every mapping of it.  The
+   memory is an array of chunks of 2^order contiguous pages: single pages
+   normally, 2 MiB with CUSTOM_MEM_HUGE_2M.  Nothing needs to be contiguous
+   beyond a chunk, and nothing is mapped before it is touched.
+   */
+struct custom_mem_buffer
+{
+    struct kref ref;
+    void *vaddr;                                    ///< Kernel address of the first chunk
+    size_t size;                                    ///< Whole chunks
+    u32 handle;
+    u32 flags;                                      ///< CUSTOM_MEM_*, CUSTOM_MEM_REGISTER_* when user
+    struct page **chunks;
+    unsigned int nr_chunks;
+    unsigned int order;
+    int node;                                       ///< Where the chunks are, or CUSTOM_MEM_NODE_INTERLEAVE
+    struct mutex lock;                              ///< attachments
+    struct list_head attachments;                   ///< struct custom_mem_attachment of exported dma-bufs
+
+    //DEV_MEM_REGISTER only, the chunks are pinned user pages
+    bool user;
+    bool stale;                                     ///< The range changed under us, never reuse
+    unsigned long uaddr;
+    unsigned int users;                             ///< Registrations not unregistered yet, under reg_lock
+    struct mm_struct *mm;
+    struct mmu_interval_notifier notifier;
+    struct list_head reg_node;                      ///< custom_mem_file.regs
+};
+
+//fp->private_data, the buffers this fd allocated and has not freed yet
+struct custom_mem_file
+{
+    struct xarray buffers;                          ///< handle -> struct custom_mem_buffer
+    struct mutex reg_lock;
+    struct list_head regs;                          ///< User registrations, most recently used first
+    unsigned long reg_pages;                        ///< Pinned by regs
+};
+
+
+/*
+   Zeroed chunks ready to hand out, one pool per node and chunk size, so
+   an allocation is a list_del() per chunk instead of a trip through the
+   buddy allocator and a clear of the memory.  Freed chunks go on the
+   dirty list as they are; the pool thread zeroes them, tops the clean
+   list up to its target and gives anything above twice the target back.
+   Chunks are linked through page->lru, which is ours while we own them.
+   */
+enum
+{
+    CUSTOM_MEM_POOL_PAGE,
+    CUSTOM_MEM_POOL_HUGE,
+    CUSTOM_MEM_POOLS
+};
+
+struct custom_mem_pool
+{
+    spinlock_t lock;
+    struct list_head clean;                         ///< Zeroed
+    struct list_head dirty;                         ///< Freed, not zeroed yet
+    unsigned long nr_clean;
+    unsigned long nr_dirty;
+    unsigned int order;
+    unsigned int target;                            ///< nr_clean the pool thread aims for
+    atomic_long_t hits;                             ///< Chunks allocations took from clean
+    atomic_long_t misses;                           ///< Chunks allocations had to get from the buddy allocator
+    atomic_long_t refilled;                         ///< Chunks the pool thread got from the buddy allocator
+    atomic_long_t recycled;                         ///< Freed chunks the pool thread zeroed and kept
+};
+
+static struct custom_mem_pool (*memPools)[CUSTOM_MEM_POOLS];     ///< [nr_node_ids]
+static struct task_struct *memPoolTask;
+static DECLARE_WAIT_QUEUE_HEAD(memPoolWait);
+static bool memPoolKick;
+
+static struct custom_mem_pool* memPool(int nid, unsigned int order)
+{
+    return &memPools[nid][order ? CUSTOM_MEM_POOL_HUGE : CUSTOM_MEM_POOL_PAGE];
+}
+
+/*
+   One wakeup until the thread gets going is enough, and keeps everybody
+   else off the wait queue lock.  Pairs with the barrier in memPoolThread():
+   either the thread sees our chunks or we see the flag down.
+   */
+static void memPoolWake(void)
+{
+    smp_mb();
+    if (!READ_ONCE(memPoolKick))
+    {
+        WRITE_ONCE(memPoolKick, true);
+        wake_up(&memPoolWait);
+    }
+}
+
+//Up to n zeroed chunks from node nid into pages, under one lock; returns how many
+static unsigned int memPoolGet(int nid, unsigned int order, struct page **pages, unsigned int n)
+{
+    struct custom_mem_pool *pool = memPool(nid, order);
+    unsigned int got = 0;
+    bool low;
+
+    spin_lock(&pool->lock);
+    while (got < n && pool->nr_clean)
+    {
+        pages[got] = list_first_entry(&pool->clean, struct page, lru);
+        list_del(&pages[got]->lru);
+        pool->nr_clean--;
+        got++;
+    }
+    low = pool->nr_clean < pool->target / 2;
+    spin_unlock(&pool->lock);
+
+    if (got)
+    {
+        atomic_long_add(got, &pool->hits);
+    }
+    if (got < n)
+    {
+        atomic_long_add(n - got, &pool->misses);
+    }
+    if (low)
+    {
+        memPoolWake();
+    }
+
+    return got;
+}
+
+//Takes n chunks of node nid back, dirty; the pool thread zeroes them, the ones that do not fit are freed
+static void memPoolPut(int nid, unsigned int order, struct page **pages, unsigned int n)
+{
+    struct custom_mem_pool *pool = memPool(nid, order);
+    unsigned int i = 0;
+
+    spin_lock(&pool->lock);
+    while (i < n && pool->nr_clean + pool->nr_dirty < 2 * pool->target)
+    {
+        list_add_tail(&pages[i]->lru, &pool->dirty);
+        pool->nr_dirty++;
+        i++;
+    }
+    spin_unlock(&pool->lock);
+
+    if (i)
+    {
+        memPoolWake();
+    }
+
+    for (; i < n; i++)
+    {
+        __free_pages(pages[i], order);
+    }
+}
+
+static void memPoolClear(struct page *page, unsigned int order)
+{
+    unsigned int i;
+
+    for (i = 0; i < (1U << order); i++)
+    {
+        clear_highpage(page + i);
+    }
+}
+
+static void memPoolWork(struct custom_mem_pool *pool, int nid)
+{
+    struct page *page;
+
+    //Dirty chunks first, they cost a clear but no allocation
+    for (;;)
+    {
+        spin_lock(&pool->lock);
+        page = list_first_entry_or_null(&pool->dirty, struct page, lru);
+        if (page)
+        {
+            list_del(&page->lru);
+            pool->nr_dirty--;
+        }
+        spin_unlock(&pool->lock);
+
+        if (!page)
+        {
+            break;
+        }
+
+        memPoolClear(page, pool->order);
+
+        spin_lock(&pool->lock);
+        if (pool->nr_clean < 2 * pool->target)
+        {
+            list_add(&page->lru, &pool->clean);
+            pool->nr_clean++;
+            page = NULL;
+        }
+        spin_unlock(&pool->lock);
+
+        if (page)
+        {
+            __free_pages(page, pool->order);
+        }
+        else
+        {
+            atomic_long_inc(&pool->recycled);
+        }
+        cond_resched();
+    }
+
+    //Gives up quietly when the node is short, the next wakeup tries again
+    while (READ_ONCE(pool->nr_clean) < pool->target && !kthread_should_stop())
+    {
+        page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO | __GFP_THISNODE | __GFP_NOWARN | __GFP_NORETRY,
+                pool->order);
+        if (!page)
+        {
+            break;
+        }
+
+        spin_lock(&pool->lock);
+        list_add_tail(&page->lru, &pool->clean);
+        pool->nr_clean++;
+        spin_unlock(&pool->lock);
+
+        atomic_long_inc(&pool->refilled);
+        cond_resched();
+    }
+}
+
+static int memPoolThread(void *data)
+{
+    int nid, i;
+
+    while (!kthread_should_stop())
+    {
+        wait_event_interruptible(memPoolWait, READ_ONCE(memPoolKick) || kthread_should_stop());
+        WRITE_ONCE(memPoolKick, false);
+        smp_mb();
+
+        for_each_node_state(nid, N_MEMORY)
+        {
+            for (i = 0; i < CUSTOM_MEM_POOLS; i++)
+            {
+                memPoolWork(&memPools[nid][i], nid);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void memPoolDrain(struct custom_mem_pool *pool)
+{
+    struct page *page, *next;
+
+    list_for_each_entry_safe(page, next, &pool->clean, lru)
+    {
+        __free_pages(page, pool->order);
+    }
+    list_for_each_entry_safe(page, next, &pool->dirty, lru)
+    {
+        __free_pages(page, pool->order);
+    }
+}
+
+static void memPoolExit(void)
+{
+    int nid, i;
+
+    kthread_stop(memPoolTask);
+
+    for (nid = 0; nid < nr_node_ids; nid++)
+    {
+        for (i = 0; i < CUSTOM_MEM_POOLS; i++)
+        {
+            memPoolDrain(&memPools[nid][i]);
+        }
+    }
+    kfree(memPools);
+}
+
+static int memPoolInit(void)
+{
+    struct custom_mem_pool *pool;
+    int nid, i;
+
+    memPools = kcalloc(nr_node_ids, sizeof(*memPools), GFP_KERNEL);
+    if (!memPools)
+    {
+        return -ENOMEM;
+    }
+
+    for (nid = 0; nid < nr_node_ids; nid++)
+    {
+        for (i = 0; i < CUSTOM_MEM_POOLS; i++)
+        {
+            pool = &memPools[nid][i];
+            spin_lock_init(&pool->lock);
+            INIT_LIST_HEAD(&pool->clean);
+            INIT_LIST_HEAD(&pool->dirty);
+            pool->order = i == CUSTOM_MEM_POOL_HUGE ? CUSTOM_MEM_HUGE_ORDER : 0;
+            pool->target = i == CUSTOM_MEM_POOL_HUGE ? pool_huge : pool_pages;
+        }
+    }
+
+    //Fills the pools right away
+    memPoolKick = true;
+    memPoolTask = kthread_run(memPoolThread, NULL, "custom_mem_pool");
+    if (IS_ERR(memPoolTask))
+    {
+        kfree(memPools);
+        return PTR_ERR(memPoolTask);
+    }
+
+    return 0;
+}
+
+
+//Length of the run of chunks from the same node starting at from, up to the first missing one
+static unsigned int memRun(struct custom_mem_buffer *buf, unsigned int from, unsigned int to)
+{
+    int nid = page_to_nid(buf->chunks[from]);
+    unsigned int i = from + 1;
+
+    while (i < to && buf->chunks[i] && page_to_nid(buf->chunks[i]) == nid)
+    {
+        i++;
+    }
+
+    return i - from;
+}
+
+//Node counters for chunks [from, to), one atomic per run rather than per chunk
+static void memCount(struct custom_mem_buffer *buf, unsigned int from, unsigned int to, int local)
+{
+    unsigned int i, n;
+    long pages;
+    int nid;
+
+    for (i = from; i < to; i += n)
+    {
+        n = memRun(buf, i, to);
+        nid = page_to_nid(buf->chunks[i]);
+        pages = (long)n << buf->order;
+
+        atomic_long_add(pages, &nodeStats[nid].pages);
+        atomic_long_add(pages, &nodeStats[nid].allocated);
+        if (nid != local)
+        {
+            atomic_long_add(pages, &nodeStats[nid].remote);
+        }
+
+        if (!i)
+        {
+            buf->node = nid;
+        }
+        else if (nid != buf->node)
+        {
+            buf->node = CUSTOM_MEM_NODE_INTERLEAVE;
+        }
+    }
+}
+
+//Chunks back to their pools, for a buffer that never made it into the node counters
+static void memPut(struct custom_mem_buffer *buf)
+{
+    unsigned int i, n;
+
+    for (i = 0; i < buf->nr_chunks && buf->chunks[i]; i += n)
+    {
+        n = memRun(buf, i, buf->nr_chunks);
+        memPoolPut(page_to_nid(buf->chunks[i]), buf->order, &buf->chunks[i], n);
+    }
+    kvfree(buf->chunks);
+}
+
+static void memFree(struct custom_mem_buffer *buf)
+{
+    unsigned int i, n;
+
+    for (i = 0; i < buf->nr_chunks; i += n)
+    {
+        n = memRun(buf, i, buf->nr_chunks);
+        atomic_long_sub((long)n << buf->order, &nodeStats[page_to_nid(buf->chunks[i])].pages);
+    }
+    memPut(buf);
+}
+
+/*
+   Zeroed chunks of 2^order pages for buf->size bytes, placed by node as in
+   struct custom_mem_alloc.  They come from the pool of the node asked for
+   when it has any, else straight from the buddy allocator.  For 2 MiB
+   chunks RETRY_MAYFAIL lets compaction work hard without dragging the OOM
+   killer into it.
+   */
+static int memAlloc(struct custom_mem_buffer *buf, unsigned int order, int node)
+{
+    gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_RETRY_MAYFAIL;
+    int local = numa_mem_id();
+    int nid = local;
+    unsigned int i, j, n;
+
+    if (node >= 0)
+    {
+        gfp |= __GFP_THISNODE;
+        nid = node;
+    }
+
+    buf->order = order;
+    buf->nr_chunks = buf->size >> (CUSTOM_MEM_PAGE_SHIFT + order);
+    buf->chunks = kvcalloc(buf->nr_chunks, sizeof(*buf->chunks), GFP_KERNEL);
+    if (!buf->chunks)
+    {
+        return -ENOMEM;
+    }
+
+    //As many chunks per pool visit as we can, one at a time when interleaving
+    for (i = 0; i < buf->nr_chunks; i += n)
+    {
+        if (node == CUSTOM_MEM_NODE_INTERLEAVE && i)
+        {
+            nid = next_node_in(nid, node_states[N_MEMORY]);
+        }
+        n = node == CUSTOM_MEM_NODE_INTERLEAVE ? 1 : buf->nr_chunks - i;
+
+        for (j = i + memPoolGet(nid, buf->order, &buf->chunks[i], n); j < i + n; j++)
+        {
+            buf->chunks[j] = alloc_pages_node(nid, gfp, buf->order);
+            if (!buf->chunks[j])
+            {
+                break;
+            }
+        }
+
+        if (j < i + n)
+        {
+            printk("(custom_mem) memAlloc() got %u of %u chunks\n", j, buf->nr_chunks);
+            memPut(buf);
+            return -ENOMEM;
+        }
+    }
+
+    //Only a whole buffer counts, a failed one would leave allocated and remote too high
+    memCount(buf, 0, buf->nr_chunks, local);
+
+    buf->vaddr = page_address(buf->chunks[0]);
+    pr_debug("(custom_mem) memAlloc() %u chunks of order %u, asked for node %d, got %d\n", buf->nr_chunks,
+            buf->order, node, buf->node);
+
+    return 0;
+}
+
+//pfn of page index idx of a buffer
+static unsigned long memPfn(struct custom_mem_buffer *buf, pgoff_t idx)
+{
+    return page_to_pfn(buf->chunks[idx >> buf->order]) + (idx & ((1UL << buf->order) - 1));
+}
+
+
+/*
+   x86 keeps one memory type per physical page: a user mapping asking for
+   WC or UC on RAM gets WB anyway unless the kernel's own mapping of the
+   page says the same, and two mappings that disagree are not allowed.  So
+   the linear map of every chunk is switched first, and back to WB before
+   the chunks go back to the pool.  Elsewhere the user mapping's pgprot is
+   all there is to it.
+   */
+static int memSetCaching(struct custom_mem_buffer *buf, u32 cache)
+{
+#ifdef CONFIG_X86
+    unsigned long addr;
+    unsigned int i;
+    int ret = 0;
+
+    for (i = 0; i < buf->nr_chunks; i++)
+    {
+        addr = (unsigned long)page_address(buf->chunks[i]);
+        if (cache == CUSTOM_MEM_CACHE_WC)
+        {
+            ret = set_memory_wc(addr, 1 << buf->order);
+        }
+        else if (cache == CUSTOM_MEM_CACHE_UC)
+        {
+            ret = set_memory_uc(addr, 1 << buf->order);
+        }
+        else
+        {
+            ret = set_memory_wb(addr, 1 << buf->order);
+        }
+
+        if (ret)
+        {
+            printk("(custom_mem) memSetCaching() chunk %u of %u: %d\n", i, buf->nr_chunks, ret);
+            break;
+        }
+    }
+
+    //Whatever got switched goes back
+    if (ret && cache != CUSTOM_MEM_CACHE_WB)
+    {
+        while (i--)
+        {
+            set_memory_wb((unsigned long)page_address(buf->chunks[i]), 1 << buf->order);
+        }
+    }
+
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+
+static void dev_mem_buffer_release(struct kref *ref)
+{
+    struct custom_mem_buffer *buf = container_of(ref, struct custom_mem_buffer, ref);
+
+    pr_debug("(custom_mem) buffer %u released\n", buf->handle);
+    if (buf->user)
+    {
+        unpin_user_pages_dirty_lock(buf->chunks, buf->nr_chunks, buf->flags & CUSTOM_MEM_REGISTER_WRITE);
+        atomic64_sub(buf->nr_chunks, &buf->mm->pinned_vm);
+        mmdrop(buf->mm);
+        kvfree(buf->chunks);
+        kfree(buf);
+        return;
+    }
+
+    if ((buf->flags & CUSTOM_MEM_CACHE_MASK) != CUSTOM_MEM_CACHE_WB)
+    {
+        memSetCaching(buf, CUSTOM_MEM_CACHE_WB);
+    }
+    memFree(buf);
+    kfree(buf);
+    this_cpu_inc(memStats.frees);
+}
+
+static void dev_mem_buffer_put(struct custom_mem_buffer *buf)
+{
+    kref_put(&buf->ref, dev_mem_buffer_release);
+}
+
+
+//Drops the table's reference, mappings keep the memory until munmap()
+static int dev_mem_free(struct file *fp, uint32_t cmd, unsigned long arg)
+{
+    struct custom_mem_file *cf = fp->private_data;
+    struct custom_mem_buffer *buf;
+    u64 handle;
+
+    if (get_user(handle, (u64 __user*)arg))
+    {
+        return -EFAULT;
+    }
+
+    if (!handle || handle > INT_MAX)
+    {
+        return -EINVAL;
+    }
+
+    //Registrations go through DEV_MEM_UNREGISTER
+    xa_lock(&cf->buffers);
+    buf = xa_load(&cf->buffers, handle);
+    if (buf && !buf->user)
+    {
+        __xa_erase(&cf->buffers, handle);
+    }
+    xa_unlock(&cf->buffers);
+
+    if (!buf || buf->user)
+    {
+        printk("(custom_mem) dev_mem_free() no buffer %llu\n", handle);
+        return -EINVAL;
+    }
+
+    pr_debug("(custom_mem) dev_mem_free() %u %p %s\n", buf->handle, buf->vaddr, (char*)buf->vaddr);
+    dev_mem_buffer_put(buf);
+
+    return 0;
+}
+
+static int dev_mem_alloc(struct file* fp, uint32_t cmd, unsigned long arg)
+{
+    struct custom_mem_file *cf = fp->private_data;
+    struct custom_mem_alloc req;
+    struct custom_mem_buffer *buf;
+    int ret;
+
+    if (copy_from_user(&req, (void __user*)arg, sizeof(req)))
+    {
+        return -EFAULT;
+    }
+
+    pr_debug("(custom_mem) dev_mem_alloc() Allocation request size = %llu flags = %x\n", req.size, req.flags);
+    if (!req.size || req.size > (1ULL << CUSTOM_MEM_HANDLE_SHIFT) ||
+        (req.flags & ~(CUSTOM_MEM_HUGE_2M | CUSTOM_MEM_HUGE_1G | CUSTOM_MEM_CACHE_MASK)) ||
+        (req.flags & CUSTOM_MEM_CACHE_MASK) > CUSTOM_MEM_CACHE_UC)
+    {
+        return -EINVAL;
+    }
+
+    if (req.node < CUSTOM_MEM_NODE_INTERLEAVE ||
+        (req.node >= 0 && (req.node >= nr_node_ids || !node_state(req.node, N_MEMORY))))
+    {
+        printk("(custom_mem) dev_mem_alloc() no memory on node %d\n", req.node);
+        return -EINVAL;
+    }
+
+    //Beyond MAX_PAGE_ORDER, and alloc_contig_pages() is not there for modules
+    if (req.flags & CUSTOM_MEM_HUGE_1G)
+    {
+        return -EOPNOTSUPP;
+    }
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+
+    kref_init(&buf->ref);
+    mutex_init(&buf->lock);
+    INIT_LIST_HEAD(&buf->attachments);
+    buf->flags = req.flags;
+    if (req.flags & CUSTOM_MEM_HUGE_2M)
+    {
+        buf->size = ALIGN(req.size, CUSTOM_MEM_HUGE_SIZE);
+        ret = memAlloc(buf, CUSTOM_MEM_HUGE_ORDER, req.node);
+    }
+    else
+    {
+        buf->size = CUSTOM_MEM_PAGE_ALIGN(req.size);
+        ret = memAlloc(buf, 0, req.node);
+    }
+    if (ret)
+    {
+        kfree(buf);
+        return ret;
+    }
+
+    if ((buf->flags & CUSTOM_MEM_CACHE_MASK) != CUSTOM_MEM_CACHE_WB)
+    {
+        ret = memSetCaching(buf, buf->flags & CUSTOM_MEM_CACHE_MASK);
+        if (ret)
+        {
+            memFree(buf);
+            kfree(buf);
+            return ret;
+        }
+    }
+    strcpy((char*)buf->vaddr, "Hello from kernel space");
+    this_cpu_inc(memStats.allocations);
+
+    ret = xa_alloc(&cf->buffers, &buf->handle, buf, CUSTOM_MEM_HANDLES, GFP_KERNEL);
+    if (ret)
+    {
+        dev_mem_buffer_put(buf);
+        return ret;
+    }
+
+    req.handle = buf->handle;
+    req.offset = (u64)buf->handle << CUSTOM_MEM_HANDLE_SHIFT;
+    req.size = buf->size;
+    req.node = buf->node;
+
+    if (copy_to_user((void __user*)arg, &req, sizeof(req)))
+    {
+        //Nobody learned the handle, so nobody can be using it
+        xa_erase(&cf->buffers, buf->handle);
+        dev_mem_buffer_put(buf);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+
+/*
+   User memory registrations.  DEV_MEM_REGISTER pins a user range and gives
+   it a handle like any buffer, so it can be exported as a dma-buf, but it
+   is never mapped again: the pages already are.
+
+   Pinning is the expensive part, so DEV_MEM_UNREGISTER only drops a user
+   count and leaves the pages pinned, and the next registration of a range
+   inside one that is still pinned gets the same handle back.  Ranges that
+   nobody uses any more are unpinned oldest first once the fd has more
+   than reg_cache_pages pinned.  An interval notifier on every range marks
+   it stale as soon as the mapping behind it changes (munmap, mremap,
+   mprotect, fork...), so the cache never hands out pages that are no
+   longer at that address.  Pinned pages count against RLIMIT_MEMLOCK the
+   same way RDMA registrations do.
+   */
+static bool dev_reg_invalidate(struct mmu_interval_notifier *mni, const struct mmu_notifier_range *range,
+        unsigned long cur_seq)
+{
+    struct custom_mem_buffer *buf = container_of(mni, struct custom_mem_buffer, notifier);
+
+    mmu_interval_set_seq(mni, cur_seq);
+    WRITE_ONCE(buf->stale, true);
+
+    return true;
+}
+
+static const struct mmu_interval_notifier_ops dev_reg_notifier_ops =
+{
+    .invalidate = dev_reg_invalidate,
+};
+
+//Under reg_lock: unpins once mappings and dma-bufs are done with it
+static void dev_reg_evict(struct custom_mem_file *cf, struct custom_mem_buffer *buf)
+{
+    list_del(&buf->reg_node);
+    cf->reg_pages -= buf->nr_chunks;
+    mmu_interval_notifier_remove(&buf->notifier);
+    xa_erase(&cf->buffers, buf->handle);
+    dev_mem_buffer_put(buf);
+}
+
+//Under reg_lock: unused ranges go, stale ones first, then the oldest
+static void dev_reg_trim(struct custom_mem_file *cf)
+{
+    struct custom_mem_buffer *buf, *next;
+
+    list_for_each_entry_safe_reverse(buf, next, &cf->regs, reg_node)
+    {
+        if (!buf->users && (READ_ONCE(buf->stale) || cf->reg_pages > reg_cache_pages))
+        {
+            dev_reg_evict(cf, buf);
+        }
+    }
+}
+
+//Under reg_lock: a live registration that covers [start, end) with the access asked for
+static struct custom_mem_buffer* dev_reg_lookup(struct custom_mem_file *cf, unsigned long start,
+        unsigned long end, u32 flags)
+{
+    struct custom_mem_buffer *buf;
+
+    list_for_each_entry(buf, &cf->regs, reg_node)
+    {
+        if (buf->mm == current->mm && !READ_ONCE(buf->stale) &&
+            buf->uaddr <= start && end <= buf->uaddr + buf->size &&
+            (buf->flags & flags) == flags)
+        {
+            return buf;
+        }
+    }
+
+    return NULL;
+}
+
+static int dev_reg_pin(struct custom_mem_buffer *buf)
+{
+    unsigned long locked, limit;
+    unsigned long seq;
+    int pinned;
+
+    locked = atomic64_add_return(buf->nr_chunks, &current->mm->pinned_vm);
+    limit = rlimit(RLIMIT_MEMLOCK) >> CUSTOM_MEM_PAGE_SHIFT;
+    if (locked > limit && !capable(CAP_IPC_LOCK))
+    {
+        atomic64_sub(buf->nr_chunks, &current->mm->pinned_vm);
+        return -ENOMEM;
+    }
+
+    //Invalidations from here on mark the registration stale
+    seq = mmu_interval_read_begin(&buf->notifier);
+
+    pinned = pin_user_pages_fast(buf->uaddr, buf->nr_chunks,
+            FOLL_LONGTERM | ((buf->flags & CUSTOM_MEM_REGISTER_WRITE) ? FOLL_WRITE : 0), buf->chunks);
+    if (pinned != buf->nr_chunks)
+    {
+        if (pinned > 0)
+        {
+            unpin_user_pages(buf->chunks, pinned);
+        }
+        atomic64_sub(buf->nr_chunks, &current->mm->pinned_vm);
+        return pinned < 0 ? pinned : -EFAULT;
+    }
+
+    if (mmu_interval_read_retry(&buf->notifier, seq))
+    {
+        WRITE_ONCE(buf->stale, true);
+    }
+
+    return 0;
+}
+
+static int dev_mem_register(struct file *fp, uint32_t cmd, unsigned long arg)
+{
+    struct custom_mem_file *cf = fp->private_data;
+    struct custom_mem_register req;
+    struct custom_mem_buffer *buf;
+    unsigned long start, end;
+    int ret;
+
+    if (copy_from_user(&req, (void __user*)arg, sizeof(req)))
+    {
+        return -EFAULT;
+    }
+
+    start = req.addr & CUSTOM_MEM_PAGE_MASK;
+    end = CUSTOM_MEM_PAGE_ALIGN(req.addr + req.length);
+    if (!req.length || end <= start || end - start > (1UL << CUSTOM_MEM_HANDLE_SHIFT) ||
+        (req.flags & ~CUSTOM_MEM_REGISTER_WRITE))
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&cf->reg_lock);
+
+    buf = dev_reg_lookup(cf, start, end, req.flags);
+    if (buf)
+    {
+        buf->users++;
+        list_move(&buf->reg_node, &cf->regs);
+        req.cached = 1;
+        goto done;
+    }
+
+    buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+    {
+        ret = -ENOMEM;
+        goto unlock;
+    }
+
+    kref_init(&buf->ref);
+    mutex_init(&buf->lock);
+    INIT_LIST_HEAD(&buf->attachments);
+    buf->user = true;
+    buf->flags = req.flags;
+    buf->uaddr = start;
+    buf->size = end - start;
+    buf->nr_chunks = buf->size >> CUSTOM_MEM_PAGE_SHIFT;
+    buf->node = CUSTOM_MEM_NODE_INTERLEAVE;
+    buf->chunks = kvcalloc(buf->nr_chunks, sizeof(*buf->chunks), GFP_KERNEL);
+    if (!buf->chunks)
+    {
+        kfree(buf);
+        ret = -ENOMEM;
+        goto unlock;
+    }
+
+    ret = mmu_interval_notifier_insert(&buf->notifier, current->mm, start, buf->size, &dev_reg_notifier_ops);
+    if (ret)
+    {
+        kvfree(buf->chunks);
+        kfree(buf);
+        goto unlock;
+    }
+
+    ret = dev_reg_pin(buf);
+    if (ret)
+    {
+        mmu_interval_notifier_remove(&buf->notifier);
+        kvfree(buf->chunks);
+        kfree(buf);
+        goto unlock;
+    }
+
+    //Held until the buffer is released, for pinned_vm
+    buf->mm = current->mm;
+    mmgrab(buf->mm);
+
+    ret = xa_alloc(&cf->buffers, &buf->handle, buf, CUSTOM_MEM_HANDLES, GFP_KERNEL);
+    if (ret)
+    {
+        mmu_interval_notifier_remove(&buf->notifier);
+        dev_mem_buffer_put(buf);
+        goto unlock;
+    }
+
+    buf->users = 1;
+    list_add(&buf->reg_node, &cf->regs);
+    cf->reg_pages += buf->nr_chunks;
+    req.cached = 0;
+
+done:
+    req.handle = buf->handle;
+    req.offset = req.addr - buf->uaddr;
+    dev_reg_trim(cf);
+    ret = 0;
+
+    pr_debug("(custom_mem) dev_mem_register() %llx + %llu is %llu at %llu%s, %lu pages pinned\n", req.addr,
+            req.length, req.handle, req.offset, req.cached ? " (cached)" : "", cf->reg_pages);
+
+    //Nobody learned the handle, so this use of it is over
+    if (copy_to_user((void __user*)arg, &req, sizeof(req)))
+    {
+        buf->users--;
+        dev_reg_trim(cf);
+        ret = -EFAULT;
+    }
+
+unlock:
+    mutex_unlock(&cf->reg_lock);
+
+    return ret;
+}
+
+static int dev_mem_unregister(struct file *fp, uint32_t cmd, unsigned long arg)
+{
+    struct custom_mem_file *cf = fp->private_data;
+    struct custom_mem_buffer *buf;
+    u64 handle;
+    int ret = 0;
+
+    if (get_user(handle, (u64 __user*)arg))
+    {
+        return -EFAULT;
+    }
+
+    if (!handle || handle > INT_MAX)
+    {
+        return -EINVAL;
+    }
+
+    //Registrations only leave the table under reg_lock, other buffers under the xa_lock
+    mutex_lock(&cf->reg_lock);
+    xa_lock(&cf->buffers);
+    buf = xa_load(&cf->buffers, handle);
+    if (buf && !buf->user)
+    {
+        buf = NULL;
+    }
+    xa_unlock(&cf->buffers);
+
+    if (!buf || !buf->users)
+    {
+        ret = -EINVAL;
+    }
+    else
+    {
+        buf->users--;
+        dev_reg_trim(cf);
+    }
+    mutex_unlock(&cf->reg_lock);
+
+    return ret;
+}
+
+
+static void dev_vm_open(struct vm_area_struct *vma)
+{
+    struct custom_mem_buffer *buf = vma->vm_private_data;
+
+    kref_get(&buf->ref);
+}
+
+static void dev_vm_close(struct vm_area_struct *vma)
+{
+    dev_mem_buffer_put(vma->vm_private_data);
+}
+
+/*
+   Maps the page that faulted and, like fault-around for files, up to
+   CUSTOM_MEM_FAULT_AROUND more after it, so a sequential pass over a big
+   buffer takes one fault per 64 KiB instead of one per page.  Pages that
+   are already mapped are left alone.
+   */
+static vm_fault_t dev_vm_fault(struct vm_fault *vmf)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct custom_mem_buffer *buf = vma->vm_private_data;
+    pgoff_t idx = vmf->pgoff;
+    pgoff_t last = buf->size >> CUSTOM_MEM_PAGE_SHIFT;
+    unsigned long addr = vmf->address & CUSTOM_MEM_PAGE_MASK;
+    vm_fault_t ret;
+    int i;
+
+    if (idx >= last)
+    {
+        return VM_FAULT_SIGBUS;
+    }
+
+    ret = vmf_insert_pfn(vma, addr, memPfn(buf, idx));
+    if (ret & VM_FAULT_ERROR)
+    {
+        return ret;
+    }
+
+    //Best effort: whatever does not go in now faults in later
+    for (i = 1; i <= CUSTOM_MEM_FAULT_AROUND; i++)
+    {
+        addr += CUSTOM_MEM_PAGE_SIZE;
+        if (addr >= vma->vm_end || idx + i >= last)
+        {
+            break;
+        }
+        if (vmf_insert_pfn(vma, addr, memPfn(buf, idx + i)) & VM_FAULT_ERROR)
+        {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+   One PMD for the whole chunk when the aligned 2 MiB around the fault lies
+   inside the mapping and lands exactly on a chunk of the buffer.  Nothing
+   stops MAP_FIXED from pairing an aligned address with an offset that is
+   not, and a PMD there would run off the end of one chunk into whatever
+   memory follows it; those mappings get 4 KiB entries instead.
+   */
+static vm_fault_t dev_vm_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct custom_mem_buffer *buf = vma->vm_private_data;
+    unsigned long addr = vmf->address & PMD_MASK;
+    pgoff_t idx;
+
+    if (order != PMD_ORDER || buf->order < PMD_ORDER || addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+    {
+        return VM_FAULT_FALLBACK;
+    }
+
+    idx = vma->vm_pgoff + ((addr - vma->vm_start) >> CUSTOM_MEM_PAGE_SHIFT);
+    if (idx & ((1UL << buf->order) - 1))
+    {
+        return VM_FAULT_FALLBACK;
+    }
+    if (idx + (1UL << buf->order) > buf->size >> CUSTOM_MEM_PAGE_SHIFT)
+    {
+        return VM_FAULT_FALLBACK;
+    }
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+    return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(memPfn(buf, idx)), vmf->flags & FAULT_FLAG_WRITE);
+#else
+    return vmf_insert_pfn_pmd(vmf, memPfn(buf, idx), vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+#endif
+
+static const struct vm_operations_struct dev_vm_ops =
+{
+    .open = dev_vm_open,
+    .close = dev_vm_close,
+    .fault = dev_vm_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .huge_fault = dev_vm_huge_fault,
+#endif
+};
+
+/*
+   Sets up a mapping of buf that starts at page vma->vm_pgoff of it, taking
+   over a reference the caller holds.  Nothing is mapped yet, the fault
+   handlers pick PMDs or PTEs as the pages get touched, so mmap() costs the
+   same for any size.
+   */
+static int dev_vm_setup(struct custom_mem_buffer *buf, struct vm_area_struct *vma)
+{
+    unsigned long pages = (vma->vm_end - vma->vm_start) >> CUSTOM_MEM_PAGE_SHIFT;
+
+    //A private mapping would be copy-on-write, which VM_PFNMAP cannot do
+    if (!(vma->vm_flags & VM_SHARED))
+    {
+        return -EINVAL;
+    }
+
+    //Already mapped where they came from
+    if (buf->user)
+    {
+        return -EINVAL;
+    }
+
+    if (vma->vm_pgoff + pages > buf->size >> CUSTOM_MEM_PAGE_SHIFT)
+    {
+        printk("(custom_mem) Mapping %lu pages at page %lu of a %zu byte buffer.\n", pages, vma->vm_pgoff,
+                buf->size);
+        return -EINVAL;
+    }
+
+    vm_flags_set(vma, VM_PFNMAP | VM_IO | VM_DONTEXPAND | VM_DONTDUMP);
+    if (buf->order)
+    {
+        vm_flags_set(vma, VM_HUGEPAGE);
+    }
+
+    //Every PTE and PMD the fault handlers insert takes it from here
+    switch (buf->flags & CUSTOM_MEM_CACHE_MASK)
+    {
+        case CUSTOM_MEM_CACHE_WC:
+            vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+            break;
+
+        case CUSTOM_MEM_CACHE_UC:
+            vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+            break;
+    }
+    vma->vm_private_data = buf;
+    vma->vm_ops = &dev_vm_ops;
+
+    return 0;
+}
+
+/*
+   The offset picks the buffer (handle << CUSTOM_MEM_HANDLE_SHIFT) and the
+   page inside it the mapping starts at.  Like DRM's fake offsets, the
+   handle is stripped off again, so from here on vm_pgoff is the page of
+   the buffer the mapping starts at.  The handle part is a multiple of
+   2 MiB, so addresses and offsets stay congruent for the huge faults.
+   */
+static int dev_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+    struct custom_mem_file *cf = fp->private_data;
+    struct custom_mem_buffer *buf;
+    unsigned long size;
+    int ret;
+
+    size = vma->vm_end - vma->vm_start;
+
+    pr_debug("(custom_mem) vma_start = %03lx vma_end = %03lx size = %ld pgoff = %lu\n",
+            vma->vm_start, vma->vm_end, size, vma->vm_pgoff);
+
+    //The table's reference cannot go away while we hold the lock
+    xa_lock(&cf->buffers);
+    buf = xa_load(&cf->buffers, vma->vm_pgoff >> CUSTOM_MEM_HANDLE_PGSHIFT);
+    if (buf)
+    {
+        kref_get(&buf->ref);
+    }
+    xa_unlock(&cf->buffers);
+
+    if (!buf)
+    {
+        printk("(custom_mem) No buffer with handle %lu.\n", vma->vm_pgoff >> CUSTOM_MEM_HANDLE_PGSHIFT);
+        return -EINVAL;
+    }
+
+    vma->vm_pgoff &= (1UL << CUSTOM_MEM_HANDLE_PGSHIFT) - 1;
+    ret = dev_vm_setup(buf, vma);
+    if (ret)
+    {
+        dev_mem_buffer_put(buf);
+    }
+
+    return ret;
+}
+
+
+/*
+   dma-buf export, modelled on the system heap: every attachment gets its
+   own copy of the scatterlist, one entry per chunk, and the buffer keeps a
+   list of them so begin/end_cpu_access can sync whatever devices have it
+   mapped.  The dma-buf holds a reference to the buffer, so DEV_MEM_FREE
+   and closing this fd do not pull the pages from under importers.
+   */
+struct custom_mem_attachment
+{
+    struct device *dev;
+    struct sg_table sgt;
+    struct list_head node;
+    bool mapped;
+};
+
+static int dev_dmabuf_attach(struct dma_buf *dmabuf, struct dma_buf_attachment *attachment)
+{
+    struct custom_mem_buffer *buf = dmabuf->priv;
+    struct custom_mem_attachment *a;
+    struct scatterlist *sg;
+    unsigned int i;
+    int ret;
+
+    a = kzalloc(sizeof(*a), GFP_KERNEL);
+    if (!a)
+    {
+        return -ENOMEM;
+    }
+
+    ret = sg_alloc_table(&a->sgt, buf->nr_chunks, GFP_KERNEL);
+    if (ret)
+    {
+        kfree(a);
+        return ret;
+    }
+
+    for_each_sgtable_sg(&a->sgt, sg, i)
+    {
+        sg_set_page(sg, buf->chunks[i], CUSTOM_MEM_PAGE_SIZE << buf->order, 0);
+    }
+
+    a->dev = attachment->dev;
+    attachment->priv = a;
+
+    mutex_lock(&buf->lock);
+    list_add(&a->node, &buf->attachments);
+    mutex_unlock(&buf->lock);
+
+    return 0;
+}
+
+static void dev_dmabuf_detach(struct dma_buf *dmabuf, struct dma_buf_attachment *attachment)
+{
+    struct custom_mem_buffer *buf = dmabuf->priv;
+    struct custom_mem_attachment *a = attachment->priv;
+
+    mutex_lock(&buf->lock);
+    list_del(&a->node);
+    mutex_unlock(&buf->lock);
+
+    sg_free_table(&a->sgt);
+    kfree(a);
+}
+
+//WC and UC buffers are never in the CPU caches, there is nothing to sync
+static unsigned long dev_dmabuf_attrs(struct custom_mem_buffer *buf)
+{
+    return (buf->flags & CUSTOM_MEM_CACHE_MASK) != CUSTOM_MEM_CACHE_WB ? DMA_ATTR_SKIP_CPU_SYNC : 0;
+}
+
+static struct sg_table* dev_dmabuf_map(struct dma_buf_attachment *attachment, enum dma_data_direction dir)
+{
+    struct custom_mem_buffer *buf = attachment->dmabuf->priv;
+    struct custom_mem_attachment *a = attachment->priv;
+    int ret;
+
+    ret = dma_map_sgtable(attachment->dev, &a->sgt, dir, dev_dmabuf_attrs(buf));
+    if (ret)
+    {
+        return ERR_PTR(ret);
+    }
+    a->mapped = true;
+
+    return &a->sgt;
+}
+
+static void dev_dmabuf_unmap(struct dma_buf_attachment *attachment, struct sg_table *sgt,
+        enum dma_data_direction dir)
+{
+    struct custom_mem_buffer *buf = attachment->dmabuf->priv;
+    struct custom_mem_attachment *a = attachment->priv;
+
+    a->mapped = false;
+    dma_unmap_sgtable(attachment->dev, sgt, dir, dev_dmabuf_attrs(buf));
+}
+
+static int dev_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+    struct custom_mem_buffer *buf = dmabuf->priv;
+    struct custom_mem_attachment *a;
+
+    if (dev_dmabuf_attrs(buf))
+    {
+        return 0;
+    }
+
+    mutex_lock(&buf->lock);
+    list_for_each_entry(a, &buf->attachments, node)
+    {
+        if (a->mapped)
+        {
+            dma_sync_sgtable_for_cpu(a->dev, &a->sgt, dir);
+        }
+    }
+    mutex_unlock(&buf->lock);
+
+    return 0;
+}
+
+static int dev_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+    struct custom_mem_buffer *buf = dmabuf->priv;
+    struct custom_mem_attachment *a;
+
+    if (dev_dmabuf_attrs(buf))
+    {
+        return 0;
+    }
+
+    mutex_lock(&buf->lock);
+    list_for_each_entry(a, &buf->attachments, node)
+    {
+        if (a->mapped)
+        {
+            dma_sync_sgtable_for_device(a->dev, &a->sgt, dir);
+        }
+    }
+    mutex_unlock(&buf->lock);
+
+    return 0;
+}
+
+//Same fault driven mappings as the device, vm_pgoff is already the page of the buffer
+static int dev_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+    struct custom_mem_buffer *buf = dmabuf->priv;
+    int ret;
+
+    kref_get(&buf->ref);
+    ret = dev_vm_setup(buf, vma);
+    if (ret)
+    {
+        dev_mem_buffer_put(buf);
+    }
+
+    return ret;
+}
+
+//One kernel mapping of all the chunks, cached the same way as the user ones
+static int dev_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+    struct custom_mem_buffer *buf = dmabuf->priv;
+    unsigned long i, n = buf->size >> CUSTOM_MEM_PAGE_SHIFT;
+    struct page **pages;
+    pgprot_t prot = PAGE_KERNEL;
+    void *vaddr;
+
+    pages = kvmalloc_array(n, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+    {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        pages[i] = buf->chunks[i >> buf->order] + (i & ((1UL << buf->order) - 1));
+    }
+
+    switch (buf->flags & CUSTOM_MEM_CACHE_MASK)
+    {
+        case CUSTOM_MEM_CACHE_WC:
+            prot = pgprot_writecombine(prot);
+            break;
+
+        case CUSTOM_MEM_CACHE_UC:
+            prot = pgprot_noncached(prot);
+            break;
+    }
+
+    vaddr = vmap(pages, n, VM_MAP, prot);
+    kvfree(pages);
+    if (!vaddr)
+    {
+        return -ENOMEM;
+    }
+
+    iosys_map_set_vaddr(map, vaddr);
+
+    return 0;
+}
+
+static void dev_dmabuf_vunmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+    vunmap(map->vaddr);
+    iosys_map_clear(map);
+}
+
+static void dev_dmabuf_release(struct dma_buf *dmabuf)
+{
+    dev_mem_buffer_put(dmabuf->priv);
+}
+
+static const struct dma_buf_ops dev_dmabuf_ops =
+{
+    .attach = dev_dmabuf_attach,
+    .detach = dev_dmabuf_detach,
+    .map_dma_buf = dev_dmabuf_map,
+    .unmap_dma_buf = dev_dmabuf_unmap,
+    .begin_cpu_access = dev_dmabuf_begin_cpu_access,
+    .end_cpu_access = dev_dmabuf_end_cpu_access,
+    .mmap = dev_dmabuf_mmap,
+    .vmap = dev_dmabuf_vmap,
+    .vunmap = dev_dmabuf_vunmap,
+    .release = dev_dmabuf_release,
+};
+
+//The fd is only installed once the caller has learned its number
+static int dev_mem_export(struct file *fp, uint32_t cmd, unsigned long arg)
+{
+    struct custom_mem_file *cf = fp->private_data;
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct custom_mem_export req;
+    struct custom_mem_buffer *buf;
+    struct dma_buf *dmabuf;
+    int fd;
+
+    if (copy_from_user(&req, (void __user*)arg, sizeof(req)))
+    {
+        return -EFAULT;
+    }
+
+    if (!req.handle || req.handle > INT_MAX || (req.flags & ~CUSTOM_MEM_EXPORT_CLOEXEC))
+    {
+        return -EINVAL;
+    }
+
+    xa_lock(&cf->buffers);
+    buf = xa_load(&cf->buffers, req.handle);
+    if (buf)
+    {
+        kref_get(&buf->ref);
+    }
+    xa_unlock(&cf->buffers);
+
+    if (!buf)
+    {
+        return -EINVAL;
+    }
+
+    exp_info.ops = &dev_dmabuf_ops;
+    exp_info.size = buf->size;
+    exp_info.flags = O_RDWR;
+    exp_info.priv = buf;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf))
+    {
+        dev_mem_buffer_put(buf);
+        return PTR_ERR(dmabuf);
+    }
+
+    //From here on the dma-buf owns our reference
+    fd = get_unused_fd_flags(O_RDWR | ((req.flags & CUSTOM_MEM_EXPORT_CLOEXEC) ? O_CLOEXEC : 0));
+    if (fd < 0)
+    {
+        dma_buf_put(dmabuf);
+        return fd;
+    }
+
+    req.fd = fd;
+    if (copy_to_user((void __user*)arg, &req, sizeof(req)))
+    {
+        put_unused_fd(fd);
+        dma_buf_put(dmabuf);
+        return -EFAULT;
+    }
+
+    fd_install(fd, dmabuf->file);
+    pr_debug("(custom_mem) dev_mem_export() buffer %u is fd %d\n", buf->handle, fd);
+
+    return 0;
+}
+
+
+/*
+   Runs the fault handlers over a range of a mapping of this fd, the same
+   way a touch of every page would, PMDs included.
+   */
+static int dev_mem_prefault(struct file *fp, uint32_t cmd, unsigned long arg)
+{
+    struct custom_mem_range req;
+    struct mm_struct *mm = current->mm;
+    struct vm_area_struct *vma;
+    unsigned long addr, end;
+    unsigned int fault_flags;
+    bool unlocked;
+    int ret = 0;
+
+    if (copy_from_user(&req, (void __user*)arg, sizeof(req)))
+    {
+        return -EFAULT;
+    }
+
+    addr = req.addr & CUSTOM_MEM_PAGE_MASK;
+    end = CUSTOM_MEM_PAGE_ALIGN(req.addr + req.length);
+    if (!req.length || end <= addr)
+    {
+        return -EINVAL;
+    }
+
+    mmap_read_lock(mm);
+    while (addr < end)
+    {
+        //Looked up again every time, fixup_user_fault() may drop the lock
+        vma = vma_lookup(mm, addr);
+        if (!vma || vma->vm_file != fp || vma->vm_ops != &dev_vm_ops || end > vma->vm_end)
+        {
+            ret = -EINVAL;
+            break;
+        }
+
+        if (fatal_signal_pending(current))
+        {
+            ret = -EINTR;
+            break;
+        }
+
+        fault_flags = (vma->vm_flags & VM_WRITE) ? FAULT_FLAG_WRITE : 0;
+        unlocked = false;
+        ret = fixup_user_fault(mm, addr, fault_flags, &unlocked);
+        if (ret)
+        {
+            break;
+        }
+
+        addr += CUSTOM_MEM_PAGE_SIZE;
+    }
+    mmap_read_unlock(mm);
+
+    pr_debug("(custom_mem) dev_mem_prefault() %llx + %llu: %d\n", req.addr, req.length, ret);
+
+    return ret;
+}
+
+
+static int dev_mem_node_stats(struct file *fp, uint32_t cmd, unsigned long arg)
+{
+    struct custom_mem_node_stats st;
+
+    if (copy_from_user(&st, (void __user*)arg, sizeof(st)))
+    {
+        return -EFAULT;
+    }
+
+    if (st.node < 0 || st.node >= nr_node_ids)
+    {
+        return -EINVAL;
+    }
+
+    st.reserved = 0;
+    st.pages = atomic_long_read(&nodeStats[st.node].pages);
+    st.allocated = atomic_long_read(&nodeStats[st.node].allocated);
+    st.remote = atomic_long_read(&nodeStats[st.node].remote);
+
+    if (copy_to_user((void __user*)arg, &st, sizeof(st)))
+    {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+
+//Sums over nodes, for the pool of the chunk size the flags pick
+static int dev_mem_pool_stats(struct file *fp, uint32_t cmd, unsigned long arg)
+{
+    struct custom_mem_pool_stats st;
+    struct custom_mem_pool *pool;
+    int nid;
+
+    if (copy_from_user(&st, (void __user*)arg, sizeof(st)))
+    {
+        return -EFAULT;
+    }
+
+    if (st.flags & ~CUSTOM_MEM_HUGE_2M)
+    {
+        return -EINVAL;
+    }
+
+    memset(&st.chunk_size, 0, sizeof(st) - offsetof(struct custom_mem_pool_stats, chunk_size));
+    for (nid = 0; nid < nr_node_ids; nid++)
+    {
+        pool = &memPools[nid][(st.flags & CUSTOM_MEM_HUGE_2M) ? CUSTOM_MEM_POOL_HUGE : CUSTOM_MEM_POOL_PAGE];
+        st.chunk_size = CUSTOM_MEM_PAGE_SIZE << pool->order;
+        st.target += pool->target;
+        st.clean += READ_ONCE(pool->nr_clean);
+        st.dirty += READ_ONCE(pool->nr_dirty);
+        st.hits += atomic_long_read(&pool->hits);
+        st.misses += atomic_long_read(&pool->misses);
+        st.refilled += atomic_long_read(&pool->refilled);
+        st.recycled += atomic_long_read(&pool->recycled);
+    }
+
+    if (copy_to_user((void __user*)arg, &st, sizeof(st)))
+    {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+
+//Device wide counters, the per CPU ones summed up; a snapshot, not exact under load
+static int dev_mem_stats(struct file *fp, uint32_t cmd, unsigned long arg)
+{
+    struct custom_mem_stats st = {};
+    struct custom_mem_cpu_stats *cs;
+    int cpu;
+
+    st.opens = atomic_long_read(&numberOpens);
+    st.open_files = atomic_long_read(&openFiles);
+    for_each_possible_cpu(cpu)
+    {
+        cs = per_cpu_ptr(&memStats, cpu);
+        st.allocations += READ_ONCE(cs->allocations);
+        st.frees += READ_ONCE(cs->frees);
+    }
+
+    if (copy_to_user((void __user*)arg, &st, sizeof(st)))
+    {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+
+static long dev_ioctl(struct file *fp, uint32_t cmd, unsigned long arg)
+{
+    int ret;
+    pr_debug("(custom_mem) dev_ioctl() cmd = %d arg = %ld\n", cmd, arg);
+
+    switch (cmd) {
+        case DEV_MEM_ALLOC:
+            ret = dev_mem_alloc(fp, cmd, arg);
+            break;
+
+        case DEV_MEM_FREE:
+            ret = dev_mem_free(fp, cmd, arg);
+            break;
+
+        case DEV_MEM_PREFAULT:
+            ret = dev_mem_prefault(fp, cmd, arg);
+            break;
+
+        case DEV_MEM_NODE_STATS:
+            ret = dev_mem_node_stats(fp, cmd, arg);
+            break;
+
+        case DEV_MEM_POOL_STATS:
+            ret = dev_mem_pool_stats(fp, cmd, arg);
+            break;
+
+        case DEV_MEM_EXPORT:
+            ret = dev_mem_export(fp, cmd, arg);
+            break;
+
+        case DEV_MEM_REGISTER:
+            ret = dev_mem_register(fp, cmd, arg);
+            break;
+
+        case DEV_MEM_UNREGISTER:
+            ret = dev_mem_unregister(fp, cmd, arg);
+            break;
+
+        case DEV_MEM_STATS:
+            ret = dev_mem_stats(fp, cmd, arg);
+            break;
+
+        default:
+            printk("(custom_mem) default IOCTL\n");
+            return -ENOTTY;
+    }
+
+    return ret;
+}
+
+
+static int dev_open(struct inode *inodep, struct file *filep){
+    struct custom_mem_file *cf;
+
+    cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+    if (!cf)
+    {
+        return -ENOMEM;
+    }
+    xa_init_flags(&cf->buffers, XA_FLAGS_ALLOC1);
+    mutex_init(&cf->reg_lock);
+    INIT_LIST_HEAD(&cf->regs);
+    filep->private_data = cf;
+
+    atomic_long_inc(&openFiles);
+    pr_debug("(custom_mem) dev_open(). Device has been opened %ld time(s).\n",
+            atomic_long_inc_return(&numberOpens));
+    return 0;
+}
+
+
+static int dev_release(struct inode *inodep, struct file *filep){
+    struct custom_mem_file *cf = filep->private_data;
+    struct custom_mem_buffer *buf;
+    unsigned long handle;
+
+    pr_debug("(custom_mem) dev_release()\n");
+
+    //Registrations still in use too, exported ones stay pinned for the importers
+    mutex_lock(&cf->reg_lock);
+    while (!list_empty(&cf->regs))
+    {
+        dev_reg_evict(cf, list_first_entry(&cf->regs, struct custom_mem_buffer, reg_node));
+    }
+    mutex_unlock(&cf->reg_lock);
+
+    //Whatever is still mapped stays alive until munmap()
+    xa_for_each(&cf->buffers, handle, buf)
+    {
+        xa_erase(&cf->buffers, handle);
+        dev_mem_buffer_put(buf);
+    }
+    xa_destroy(&cf->buffers);
+    kfree(cf);
+
+    atomic_long_dec(&openFiles);
+    return 0;
+}
+
+
+static struct file_operations fops =
+{
+    owner:THIS_MODULE,
+    mmap:dev_mmap,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    get_unmapped_area:thp_get_unmapped_area,        //2 MiB aligned for big enough mappings
+#endif
+    unlocked_ioctl:dev_ioctl,
+    compat_ioctl:dev_ioctl,
+    open:dev_open,
+    release:dev_release,
+};
+
+static int __init custom_mem_init(void)
+{
+    int ret;
+
+    ret = memPoolInit();
+    if (ret)
+    {
+        printk(KERN_ALERT "(custom_mem) Failed to start the page pool\n");
+        return ret;
+    }
+
+    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
+    if (majorNumber<0)
+    {
+        memPoolExit();
+        printk(KERN_ALERT "custom_mem: custom_mem failed to register a major number\n");
+        return majorNumber;
+    }
+    printk("(custom_mem) registered correctly with major number %d\n", majorNumber);
+
+    // Register the device class
+    customcharClass = class_create(CLASS_NAME);
+    if (IS_ERR(customcharClass))                 // Check for error and clean up if there is
+    {
+        unregister_chrdev(majorNumber, DEVICE_NAME);
+        memPoolExit();
+        printk(KERN_ALERT "(custom_mem) Failed to register device class\n");
+        return PTR_ERR(customcharClass);          // Correct way to return an error on a pointer
+    }
+    printk("(custom_mem) device class registered correctly\n");
+
+    // Register the device driver
+    customcharDevice = device_create(customcharClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
+    if (IS_ERR(customcharDevice))                // Clean up if there is an error
+    {
+        class_destroy(customcharClass);           // Repeated code but the alternative is goto statements
+        unregister_chrdev(majorNumber, DEVICE_NAME);
+        memPoolExit();
+        printk(KERN_ALERT "Failed to create the device\n");
+        return PTR_ERR(customcharDevice);
+    }
+    printk("(custom_mem) device class created correctly!\n"); // Made it! device was initialized
+
+    return 0;
+}
+
+static void __exit custom_mem_exit(void) /* Destructor */
+{
+    printk("(custom_mem) exit!\n");
+    device_destroy(customcharClass, MKDEV(majorNumber, 0));     // remove the device
+    class_unregister(customcharClass);                          // unregister the device class
+    class_destroy(customcharClass);                             // remove the device class
+    unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
+    memPoolExit();                                           // buffers are all gone with the last mapping
+}
+
+module_init(custom_mem_init);
+module_exit(custom_mem_exit);
+
+MODULE_LICENSE("GPL");
+//The namespace became a string literal in 6.13
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+MODULE_IMPORT_NS(DMA_BUF);
+#else
+MODULE_IMPORT_NS("DMA_BUF");
+#endif
+
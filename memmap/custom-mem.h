@@ -0,0 +1,180 @@
+/*
+   ================================================================
+Name        : custom-mem.h
+Description : Interface shared by custom-mem.ko and its clients
+================================================================
+*/
+
+#ifndef CUSTOM_MEM_H
+#define CUSTOM_MEM_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define CUSTOM_MEM_DEVICE               "/dev/custom_mem_drv"
+
+/*
+   Every open file has a table of buffers of its own.  DEV_MEM_ALLOC takes
+   the size in bytes and hands back a handle and the mmap() offset of the
+   new buffer:
+
+       mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, alloc.offset)
+
+   maps it from its first byte (add a page multiple to map a part of it),
+   so one fd serves any number of buffers of up to 1 GiB each.  Mappings
+   must be MAP_SHARED, MAP_PRIVATE fails with EINVAL.  DEV_MEM_FREE takes
+   the handle back.  A buffer that is still mapped lives on until the last
+   mapping goes away; closing the fd frees everything else.  Fds share no
+   lock, so processes that open the device each for themselves do not
+   wait on one another.
+
+   CUSTOM_MEM_HUGE_2M backs the buffer with physically contiguous 2 MiB
+   chunks and maps them with PMD entries, one TLB entry per chunk.  The
+   size is rounded up to whole chunks, and the kernel places the mapping
+   on a 2 MiB boundary; mappings that do not cover a whole, aligned chunk
+   fall back to 4 KiB entries for that part.  CUSTOM_MEM_HUGE_1G is
+   reserved: the page allocator cannot hand a module 1 GiB of contiguous
+   memory, so it fails with EOPNOTSUPP.
+   */
+#define CUSTOM_MEM_HUGE_2M              (1U << 0)
+#define CUSTOM_MEM_HUGE_1G              (1U << 1)
+
+/*
+   How the CPU caches every mapping of the buffer, kernel side included.
+   Write-back is the default and the right thing for memory the CPU reads.
+   Write-combining suits buffers the CPU streams into and a device or
+   another core reads: stores get merged into full lines and skip the
+   cache, reads are uncached and slow.  Uncached makes every access go to
+   memory in program order.
+   */
+#define CUSTOM_MEM_CACHE_MASK           (3U << 2)
+#define CUSTOM_MEM_CACHE_WB             (0U << 2)
+#define CUSTOM_MEM_CACHE_WC             (1U << 2)
+#define CUSTOM_MEM_CACHE_UC             (2U << 2)
+
+/*
+   node picks where the memory comes from: a node number takes it from that
+   node only and fails with ENOMEM when the node is out of it,
+   CUSTOM_MEM_NODE_LOCAL prefers the node of the calling CPU and falls back
+   to the others, CUSTOM_MEM_NODE_INTERLEAVE spreads the pages (or chunks)
+   round robin over every node with memory.  On return node is where the
+   buffer ended up, or CUSTOM_MEM_NODE_INTERLEAVE when it spans nodes.
+   */
+#define CUSTOM_MEM_NODE_LOCAL           (-1)
+#define CUSTOM_MEM_NODE_INTERLEAVE      (-2)
+
+struct custom_mem_alloc
+{
+    __u64 size;         //In: bytes, Out: rounded up to whole pages or chunks
+    __u64 handle;       //Out: non-zero, for DEV_MEM_FREE
+    __u64 offset;       //Out: mmap() offset of the buffer
+    __u32 flags;        //In: CUSTOM_MEM_*
+    __s32 node;         //In: node or CUSTOM_MEM_NODE_*, Out: where it went
+};
+
+//Pages, not bytes, for one node.  node is In, everything else Out.
+struct custom_mem_node_stats
+{
+    __s32 node;
+    __u32 reserved;
+    __u64 pages;        //Held by buffers right now
+    __u64 allocated;    //Ever handed out
+    __u64 remote;       //Handed out to a caller running on another node
+};
+
+/*
+   Pages get mapped on first touch.  DEV_MEM_PREFAULT maps a range of an
+   existing mapping of this fd up front, so the first pass over it does
+   not take page faults.  MAP_POPULATE does not work here: the core skips
+   mappings of device memory.  Both ends are rounded out to whole pages.
+   */
+struct custom_mem_range
+{
+    __u64 addr;
+    __u64 length;
+};
+
+/*
+   Allocations take zeroed chunks from a per-node pool that a kernel thread
+   keeps filled, and go to the page allocator when it is dry.  flags picks
+   the pool (0 or CUSTOM_MEM_HUGE_2M) and is In, everything else is Out,
+   in chunks summed over all nodes.
+   */
+struct custom_mem_pool_stats
+{
+    __u32 flags;
+    __u32 reserved;
+    __u64 chunk_size;   //Bytes
+    __u64 target;       //Zeroed chunks the pool thread keeps ready
+    __u64 clean;        //Zeroed chunks ready right now
+    __u64 dirty;        //Freed chunks waiting to be zeroed
+    __u64 hits;         //Chunks allocations took from the pool
+    __u64 misses;       //Chunks allocations had to get elsewhere
+    __u64 refilled;     //Chunks the pool thread allocated
+    __u64 recycled;     //Freed chunks zeroed and put back
+};
+
+/*
+   DEV_MEM_EXPORT turns a buffer into a dma-buf fd.  It can be mmap()ed
+   like the buffer itself (from offset 0, with DMA_BUF_IOCTL_SYNC around
+   CPU access), handed to other processes over a unix socket and imported
+   by drivers, all on the same pages.  The buffer lives on until the last
+   dma-buf reference and the last mapping are gone, whatever happens to
+   the handle.
+   */
+#define CUSTOM_MEM_EXPORT_CLOEXEC       (1U << 0)
+
+struct custom_mem_export
+{
+    __u64 handle;       //In
+    __u32 flags;        //In: CUSTOM_MEM_EXPORT_*
+    __s32 fd;           //Out
+};
+
+/*
+   DEV_MEM_REGISTER pins an existing range of the caller's memory and gives
+   it a handle, for DEV_MEM_EXPORT and DEV_MEM_UNREGISTER (not for mmap(),
+   the memory is mapped already).  The range is rounded out to whole
+   pages; offset says where addr is inside the registration, which may be
+   an earlier, bigger one that is still pinned (cached is 1 then).  Every
+   DEV_MEM_REGISTER needs its DEV_MEM_UNREGISTER.  Pinned pages count
+   against RLIMIT_MEMLOCK, ENOMEM past it.
+   */
+#define CUSTOM_MEM_REGISTER_WRITE       (1U << 0)       //The device may write to the pages
+
+struct custom_mem_register
+{
+    __u64 addr;         //In
+    __u64 length;       //In: bytes
+    __u64 handle;       //Out
+    __u64 offset;       //Out: of addr inside the registration
+    __u32 flags;        //In: CUSTOM_MEM_REGISTER_*
+    __u32 cached;       //Out: 1 when an existing registration was reused
+};
+
+/*
+   DEV_MEM_STATS: counters for the whole device, across all fds.  They are
+   kept per CPU and summed on the way out, so a snapshot taken while
+   others allocate may be a few operations behind.
+   */
+struct custom_mem_stats
+{
+    __u64 opens;        //Times the device was opened since load
+    __u64 open_files;   //Fds open right now
+    __u64 allocations;  //Successful DEV_MEM_ALLOCs
+    __u64 frees;        //Allocated buffers gone for good (after the last unmap or dma-buf user)
+};
+
+#define CUSTOM_MEM_IOC_MAGIC            'c'
+
+#define DEV_MEM_ALLOC                   _IOWR(CUSTOM_MEM_IOC_MAGIC, 0, struct custom_mem_alloc)
+#define DEV_MEM_FREE                    _IOW(CUSTOM_MEM_IOC_MAGIC, 1, __u64)
+#define DEV_MEM_PREFAULT                _IOW(CUSTOM_MEM_IOC_MAGIC, 2, struct custom_mem_range)
+#define DEV_MEM_NODE_STATS              _IOWR(CUSTOM_MEM_IOC_MAGIC, 3, struct custom_mem_node_stats)
+#define DEV_MEM_POOL_STATS              _IOWR(CUSTOM_MEM_IOC_MAGIC, 4, struct custom_mem_pool_stats)
+#define DEV_MEM_EXPORT                  _IOWR(CUSTOM_MEM_IOC_MAGIC, 5, struct custom_mem_export)
+#define DEV_MEM_REGISTER                _IOWR(CUSTOM_MEM_IOC_MAGIC, 6, struct custom_mem_register)
+#define DEV_MEM_UNREGISTER              _IOW(CUSTOM_MEM_IOC_MAGIC, 7, __u64)
+#define DEV_MEM_STATS                   _IOR(CUSTOM_MEM_IOC_MAGIC, 8, struct custom_mem_stats)
+
+#endif
@@ -0,0 +1,278 @@
+/*
+Broadcast ring
+
+One ring, any number of readers, each with a cursor of its own: every
+reader sees every token published after it joined, and a slot is only
+reused once every cursor has moved past it.
+
+Writers serialize on a spinlock, readers are lock-free.  A reader loads
+its cursor, copies the slot, checks that the slot still holds that
+position and then advances the cursor with a cmpxchg, so several threads
+can share a reader (one open file) and a writer can move it forward.
+
+head is the oldest position some reader may still want.  It is only
+recomputed from the cursors when the ring looks full, so readers never
+touch shared state besides their own cursor.  If the slowest reader is
+capacity tokens behind, a writer either gives up (the caller decides how
+to wait) or, with skip_ahead, moves every reader that far behind to the
+oldest position that survives and counts what they missed.
+
+With a seqno counter, tokens are numbered under the lock, so the numbers
+follow ring order exactly.
+*/
+
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+struct BroadcastSlot
+{
+	u64 sequence;	//Position + 1 of the token in here, 0 while it is rewritten
+	long value;
+	u64 enqueued;
+	u64 seqno;
+};
+
+struct BroadcastReader
+{
+	u64 cursor ____cacheline_aligned_in_smp;	//Next position to read
+	u64 skipped;	//Tokens skip_ahead took away, under the ring lock
+	u64 stalls;		//Times a writer found the ring full because of us, under the ring lock
+	struct list_head node;
+};
+
+struct Broadcast
+{
+	spinlock_t lock;	//Writers and the reader list
+	u64 tail ____cacheline_aligned_in_smp;	//Next position to publish
+	u64 head;			//Oldest position a reader may still need, under lock
+	struct list_head readers;
+	struct BroadcastSlot* slots;
+	u32 capacity;
+	u32 mask;
+};
+
+
+int Broadcast_Create(struct Broadcast* b, u32 capacity)
+{
+	memset(b, 0, sizeof(*b));
+
+	capacity = roundup_pow_of_two(capacity);
+	b->slots = kvcalloc(capacity, sizeof(struct BroadcastSlot), GFP_KERNEL);
+	if (!b->slots)
+	{
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&b->lock);
+	INIT_LIST_HEAD(&b->readers);
+	b->capacity = capacity;
+	b->mask = capacity - 1;
+
+	return 0;
+}
+
+void Broadcast_Destroy(struct Broadcast* b)
+{
+	kvfree(b->slots);
+	b->slots = NULL;
+}
+
+//New readers start at the next token published
+void Broadcast_Join(struct Broadcast* b, struct BroadcastReader* r)
+{
+	spin_lock(&b->lock);
+	r->cursor = b->tail;
+	r->skipped = 0;
+	r->stalls = 0;
+	list_add_tail(&r->node, &b->readers);
+	spin_unlock(&b->lock);
+}
+
+void Broadcast_Leave(struct Broadcast* b, struct BroadcastReader* r)
+{
+	spin_lock(&b->lock);
+	list_del(&r->node);
+	spin_unlock(&b->lock);
+}
+
+//Under lock: move head up to the slowest cursor, or pos without readers
+static void Broadcast_UpdateHead(struct Broadcast* b, u64 pos)
+{
+	struct BroadcastReader* r;
+	u64 min = pos, c;
+
+	list_for_each_entry(r, &b->readers, node)
+	{
+		c = READ_ONCE(r->cursor);
+		if ((s64)(c - min) < 0)
+		{
+			min = c;
+		}
+	}
+	b->head = min;
+}
+
+/*
+Under lock: make room for position pos.  Returns 0 when the slot of pos
+may be reused, 1 when a reader still needs it and skip_ahead is off.
+*/
+static int Broadcast_Reclaim(struct Broadcast* b, u64 pos, bool skip_ahead)
+{
+	struct BroadcastReader* r;
+	u64 floor, c, old;
+
+	Broadcast_UpdateHead(b, pos);
+
+	if (pos - b->head < b->capacity)
+	{
+		return 0;
+	}
+
+	floor = pos - b->capacity + 1;
+
+	list_for_each_entry(r, &b->readers, node)
+	{
+		c = READ_ONCE(r->cursor);
+		if ((s64)(c - floor) >= 0)
+		{
+			continue;
+		}
+
+		if (!skip_ahead)
+		{
+			WRITE_ONCE(r->stalls, r->stalls + 1);
+			continue;
+		}
+
+		//The reader may be advancing at the same time
+		while ((s64)(c - floor) < 0)
+		{
+			old = cmpxchg(&r->cursor, c, floor);
+			if (old == c)
+			{
+				WRITE_ONCE(r->skipped, r->skipped + (floor - c));
+				break;
+			}
+			c = old;
+		}
+	}
+
+	if (!skip_ahead)
+	{
+		return 1;
+	}
+
+	b->head = floor;
+
+	return 0;
+}
+
+/*
+Returns 0 once the token is visible to every reader, 1 when the slowest
+reader is a whole ring behind and skip_ahead is off.
+*/
+int Broadcast_Publish(struct Broadcast* b, long value, u64 enqueued, atomic64_t* seqno, bool skip_ahead)
+{
+	struct BroadcastSlot* slot;
+	u64 pos;
+
+	spin_lock(&b->lock);
+	pos = b->tail;
+
+	if (pos - b->head >= b->capacity && Broadcast_Reclaim(b, pos, skip_ahead))
+	{
+		spin_unlock(&b->lock);
+		return 1;
+	}
+
+	//Readers still copying the old token see the sequence change and retry
+	slot = &b->slots[pos & b->mask];
+	WRITE_ONCE(slot->sequence, 0);
+	smp_wmb();
+	WRITE_ONCE(slot->value, value);
+	WRITE_ONCE(slot->enqueued, enqueued);
+	WRITE_ONCE(slot->seqno, seqno ? atomic64_inc_return(seqno) : 0);
+	smp_store_release(&slot->sequence, pos + 1);
+
+	smp_store_release(&b->tail, pos + 1);
+	spin_unlock(&b->lock);
+
+	return 0;
+}
+
+/*
+Returns 0 and the next token for this reader, or 1 when it has seen
+everything published so far.
+*/
+int Broadcast_Read(struct Broadcast* b, struct BroadcastReader* r, long* value, u64* enqueued, u64* seqno)
+{
+	struct BroadcastSlot* slot;
+	u64 c, seq;
+	long v;
+	u64 e, n;
+
+	for (;;)
+	{
+		c = READ_ONCE(r->cursor);
+		if (c == smp_load_acquire(&b->tail))
+		{
+			return 1;
+		}
+
+		//A slot can only move on after a writer moved our cursor past it
+		slot = &b->slots[c & b->mask];
+		seq = smp_load_acquire(&slot->sequence);
+		if (seq != c + 1)
+		{
+			continue;
+		}
+
+		v = READ_ONCE(slot->value);
+		e = READ_ONCE(slot->enqueued);
+		n = READ_ONCE(slot->seqno);
+		smp_rmb();
+		if (READ_ONCE(slot->sequence) != seq)
+		{
+			continue;
+		}
+
+		if (cmpxchg(&r->cursor, c, c + 1) == c)
+		{
+			*value = v;
+			*enqueued = e;
+			*seqno = n;
+			return 0;
+		}
+	}
+}
+
+bool Broadcast_HasData(struct Broadcast* b, struct BroadcastReader* r)
+{
+	return READ_ONCE(r->cursor) != smp_load_acquire(&b->tail);
+}
+
+//Would a publish without skip_ahead go through right now
+bool Broadcast_HasSpace(struct Broadcast* b)
+{
+	bool ret;
+
+	spin_lock(&b->lock);
+	if (b->tail - b->head >= b->capacity)
+	{
+		Broadcast_UpdateHead(b, b->tail);
+	}
+	ret = b->tail - b->head < b->capacity;
+	spin_unlock(&b->lock);
+
+	return ret;
+}
+
+//Tokens published that this reader has not read yet
+u64 Broadcast_Lag(struct Broadcast* b, struct BroadcastReader* r)
+{
+	return smp_load_acquire(&b->tail) - READ_ONCE(r->cursor);
+}
@@ -0,0 +1,157 @@
+/*
+Latency histogram
+
+Log-linear buckets: values below 2^LATENCY_SUB_BITS get a bucket each,
+every power of two above that is split into 2^LATENCY_SUB_BITS equal
+buckets, so a reported percentile is at most 12.5% below the real value.
+The counters are per CPU, recording is a single this_cpu_inc() and only
+LatencyHist_Show() walks all CPUs to fold them together.
+*/
+
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+
+struct LatencyCounts
+{
+	u64 count[LATENCY_BUCKETS];
+};
+
+struct LatencyHist
+{
+	struct LatencyCounts __percpu* pcpu;
+};
+
+
+static u32 LatencyHist_Bucket(u64 ns)
+{
+	u32 msb;
+
+	if (ns < (1 << LATENCY_SUB_BITS))
+	{
+		return ns;
+	}
+
+	msb = fls64(ns) - 1;
+
+	return ((msb - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+		((ns >> (msb - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+//Smallest value that lands in bucket
+static u64 LatencyHist_Floor(u32 bucket)
+{
+	u32 msb;
+
+	if (bucket < (1 << LATENCY_SUB_BITS))
+	{
+		return bucket;
+	}
+
+	msb = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+
+	return (1ULL << msb) +
+		((u64)(bucket & ((1 << LATENCY_SUB_BITS) - 1)) << (msb - LATENCY_SUB_BITS));
+}
+
+
+int LatencyHist_Init(struct LatencyHist* hist)
+{
+	hist->pcpu = alloc_percpu(struct LatencyCounts);
+
+	return hist->pcpu ? 0 : -ENOMEM;
+}
+
+void LatencyHist_Destroy(struct LatencyHist* hist)
+{
+	free_percpu(hist->pcpu);
+	hist->pcpu = NULL;
+}
+
+void LatencyHist_Record(struct LatencyHist* hist, u64 ns)
+{
+	this_cpu_inc(hist->pcpu->count[LatencyHist_Bucket(ns)]);
+}
+
+void LatencyHist_Reset(struct LatencyHist* hist)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+	{
+		memset(per_cpu_ptr(hist->pcpu, cpu), 0, sizeof(struct LatencyCounts));
+	}
+}
+
+/*
+Print count, p50/p99/p999 and the highest bucket, followed by every
+non-empty bucket as "<floor ns> <count>".
+*/
+int LatencyHist_Show(struct LatencyHist* hist, struct seq_file* m)
+{
+	static const u32 permille[] = { 500, 990, 999 };
+	static const char* const names[] = { "p50", "p99", "p999" };
+	struct LatencyCounts* sum;
+	u64 total = 0, seen = 0;
+	u32 b, p = 0, top = 0;
+	int cpu;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+	{
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu)
+	{
+		struct LatencyCounts* c = per_cpu_ptr(hist->pcpu, cpu);
+
+		for (b = 0; b < LATENCY_BUCKETS; b++)
+		{
+			sum->count[b] += READ_ONCE(c->count[b]);
+		}
+	}
+
+	for (b = 0; b < LATENCY_BUCKETS; b++)
+	{
+		total += sum->count[b];
+		if (sum->count[b])
+		{
+			top = b;
+		}
+	}
+
+	seq_printf(m, "count %llu\n", total);
+
+	for (b = 0; b < LATENCY_BUCKETS && total && p < ARRAY_SIZE(permille); b++)
+	{
+		seen += sum->count[b];
+
+		while (p < ARRAY_SIZE(permille) && seen * 1000 >= total * permille[p])
+		{
+			seq_printf(m, "%s %llu ns\n", names[p++], LatencyHist_Floor(b));
+		}
+	}
+
+	if (total)
+	{
+		seq_printf(m, "max %llu ns\n", LatencyHist_Floor(top));
+	}
+
+	for (b = 0; b < LATENCY_BUCKETS; b++)
+	{
+		if (sum->count[b])
+		{
+			seq_printf(m, "%llu %llu\n", LatencyHist_Floor(b), sum->count[b]);
+		}
+	}
+
+	kfree(sum);
+
+	return 0;
+}
@@ -1,115 +1,588 @@
 /*
 Simple Implementation of Ring buffer
-*/
 
-#include <linux/mutex.h>
+Lock-free multi-producer/multi-consumer ring (bounded queue with a turn
+counter per slot).  A producer claims a position by advancing tail with a
+cmpxchg, fills the slot and then publishes it by storing pos + 1 in the
+slot sequence.  A consumer claims a position by advancing head and hands
+the slot back to producers by storing pos + capacity.  Nobody ever sleeps
+and the only shared writes are the two cursors and the slot itself.
 
-#define MAX_SIZE 100
+When the queue is created with percpu set every CPU also gets a private
+ring.  Inserts go to the ring of the current CPU with preemption disabled,
+so there is only ever one producer per ring and tail can be advanced with
+a plain store.  Removes drain the local ring first and then steal from the
+other CPUs, which makes ordering FIFO per CPU only.
 
-//Globals
-static DEFINE_MUTEX(kernel_lock);
-static int current_index = 0, remove_index = 0,current_size = 0;
+A ring is one allocation: the cursors (struct RBufferCtrl) followed by the
+slots.  The shared ring can be made mappable, in which case it is
+vmalloc_user() memory with the cursors alone on the first page, so user
+space can run the same protocol on it.  User space can scribble over
+anything in there, so the kernel keeps its own copy of the capacity and
+gives up after RBUFFER_SPIN_LIMIT retries instead of trusting the
+cursors to ever make progress.
 
+Capacities are powers of two so a position maps to its slot with a mask.
+Large rings come from vmalloc (kvzalloc for the per-CPU ones), so the
+capacity is only bounded by RBUFFER_MAX_CAPACITY.
 
-/*
-Linux mutex operations
+Every token carries the CLOCK_MONOTONIC time (ktime_get_ns) at which it
+was inserted, so consumers can tell how long it sat in the queue.
 
-mutex_unlock –release the mutex
-mutex_lock –get the mutex(can block)
-mutex_lock_interruptible –get the mutex, but allow interrupts
-mutex_trylock –try to get the mutexwithout blocking, otherwise return an error 
-mutex_is_locked –determine if mutexis locked
+A queue can also number its tokens: with pQueue->seqno set, a token that
+comes in without a number (seqno 0) gets the next value of that counter
+once its slot is claimed, so an insert that finds the ring full does not
+use up a number.  Tokens that already have one keep it, which is what
+moving tokens between rings wants.
 */
 
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/timekeeping.h>
+
+#define RBUFFER_MIN_CAPACITY 2
+#define RBUFFER_MAX_CAPACITY (1U << 24)
+
+//RBuffer_ShowContents() only dumps this many queued slots
+#define RBUFFER_SHOW_MAX 32
+
+#define RBUFFER_SPIN_LIMIT (1 << 16)
+
+//ctrl->flags: a consumer is about to sleep, producers must ring the doorbell
+#define RBUFFER_NEED_WAKEUP (1U << 0)
+//ctrl->flags: a producer is about to sleep on a full ring, consumers must ring
+#define RBUFFER_NEED_SPACE (1U << 1)
+
+
 struct RBuffer
 {
+	u64 sequence;	//Turn counter, owned by whoever may touch the slot next
 	long timestamp;
+	u64 enqueued;	//ktime_get_ns() at insert
+	u64 seqno;		//0 if nobody numbered it
 };
 
+//What goes in and comes out of the queue
+struct RBufferToken
+{
+	long value;
+	u64 enqueued;
+	u64 seqno;
+};
 
-void RBuffer_Init(struct RBuffer* pRBuffer)
+struct RBufferCtrl
 {
-	mutex_init(&kernel_lock);
-	current_index = remove_index = current_size = 0;
+	u64 head ____cacheline_aligned_in_smp;	//Next position to remove
+	u64 tail ____cacheline_aligned_in_smp;	//Next position to insert
+	u32 flags ____cacheline_aligned_in_smp;
+};
+
+struct RBufferRing
+{
+	struct RBufferCtrl* ctrl;
+	struct RBuffer* slots;
+	u32 capacity;
+	u32 mask;		//capacity - 1
+	void* mem;		//ctrl and slots live in here
+	size_t mem_size;
+	bool mappable;
+};
+
+struct RBufferQueue
+{
+	struct RBufferRing shared;
+	struct RBufferRing __percpu* local;	//NULL unless the per-CPU fast path is on
+	atomic64_t* seqno;	//Numbers tokens inserted without one, NULL to leave them alone
+};
+
+
+static void RBuffer_RingReset(struct RBufferRing* ring)
+{
+	u32 i;
+
+	for (i = 0; i < ring->capacity; i++)
+	{
+		ring->slots[i].sequence = i;
+		ring->slots[i].timestamp = 0;
+		ring->slots[i].enqueued = 0;
+		ring->slots[i].seqno = 0;
+	}
+
+	ring->ctrl->head = ring->ctrl->tail = 0;
+	ring->ctrl->flags = 0;
+	smp_wmb();
 }
 
-int RBuffer_Insert(struct RBuffer* pRBuffer, long value)
+static int RBuffer_RingInit(struct RBufferRing* ring, u32 capacity, int node, bool mappable)
 {
-	if (current_size  >= MAX_SIZE)
+	size_t ctrl_size = mappable ? PAGE_SIZE : sizeof(struct RBufferCtrl);
+
+	ring->mem_size = ctrl_size + sizeof(struct RBuffer) * capacity;
+
+	if (mappable)
+	{
+		ring->mem_size = PAGE_ALIGN(ring->mem_size);
+		ring->mem = vmalloc_user(ring->mem_size);
+	}
+	else
 	{
-		return 1;
+		ring->mem = kvzalloc_node(ring->mem_size, GFP_KERNEL, node);
 	}
 
-	//Protect current_index and current_size
-	mutex_lock(&kernel_lock);
+	if (!ring->mem)
+	{
+		return -ENOMEM;
+	}
+
+	ring->ctrl = ring->mem;
+	ring->slots = ring->mem + ctrl_size;
+	ring->capacity = capacity;
+	ring->mask = capacity - 1;
+	ring->mappable = mappable;
+	RBuffer_RingReset(ring);
 
-	pRBuffer[current_index].timestamp = value;
+	return 0;
+}
 
-	if (current_index + 1 >= MAX_SIZE)
+static void RBuffer_RingFree(struct RBufferRing* ring)
+{
+	if (ring->mappable)
 	{
-		current_index = 0;
+		vfree(ring->mem);
 	}
 	else
 	{
-		current_index++;
+		kvfree(ring->mem);
 	}
+	ring->mem = NULL;
+}
+
+static int RBuffer_RingPush(struct RBufferRing* ring, const struct RBufferToken* token, bool single_producer,
+	atomic64_t* seqno)
+{
+	struct RBuffer* slot;
+	u64 pos, seq, old;
+	s64 dif;
+	int spins = 0;
+
+	pos = READ_ONCE(ring->ctrl->tail);
+
+	for (;;)
+	{
+		slot = &ring->slots[pos & ring->mask];
+		seq = smp_load_acquire(&slot->sequence);
+		dif = (s64)(seq - pos);
 
-	current_size++;
-	mutex_unlock(&kernel_lock);
+		if (dif == 0)
+		{
+			if (single_producer)
+			{
+				WRITE_ONCE(ring->ctrl->tail, pos + 1);
+				break;
+			}
+
+			old = cmpxchg(&ring->ctrl->tail, pos, pos + 1);
+			if (old == pos)
+			{
+				break;
+			}
+			pos = old;
+		}
+		else if (dif < 0)
+		{
+			//The consumer of the previous lap has not released the slot: full
+			return 1;
+		}
+		else
+		{
+			pos = READ_ONCE(ring->ctrl->tail);
+		}
+
+		if (++spins > RBUFFER_SPIN_LIMIT)
+		{
+			return 1;
+		}
+	}
+
+	slot->timestamp = token->value;
+	slot->enqueued = token->enqueued;
+	slot->seqno = token->seqno || !seqno ? token->seqno : atomic64_inc_return(seqno);
+	smp_store_release(&slot->sequence, pos + 1);
 
 	return 0;
 }
 
+static int RBuffer_RingPop(struct RBufferRing* ring, struct RBufferToken* token)
+{
+	struct RBuffer* slot;
+	u64 pos, seq, old;
+	s64 dif;
+	int spins = 0;
+
+	pos = READ_ONCE(ring->ctrl->head);
+
+	for (;;)
+	{
+		slot = &ring->slots[pos & ring->mask];
+		seq = smp_load_acquire(&slot->sequence);
+		dif = (s64)(seq - (pos + 1));
+
+		if (dif == 0)
+		{
+			old = cmpxchg(&ring->ctrl->head, pos, pos + 1);
+			if (old == pos)
+			{
+				break;
+			}
+			pos = old;
+		}
+		else if (dif < 0)
+		{
+			//The producer has not published this slot yet: empty
+			return 1;
+		}
+		else
+		{
+			pos = READ_ONCE(ring->ctrl->head);
+		}
+
+		if (++spins > RBUFFER_SPIN_LIMIT)
+		{
+			return 1;
+		}
+	}
 
+	token->value = slot->timestamp;
+	token->enqueued = slot->enqueued;
+	token->seqno = slot->seqno;
+	smp_store_release(&slot->sequence, pos + ring->capacity);
 
+	return 0;
+}
 
-long RBuffer_Remove(struct RBuffer* pRBuffer)
+static int RBuffer_RingSize(struct RBufferRing* ring)
 {
-	if (current_size == 0)
+	u64 head = READ_ONCE(ring->ctrl->head);
+	u64 tail = READ_ONCE(ring->ctrl->tail);
+
+	//Both cursors move under us, clamp the snapshot to something sane
+	if ((s64)(tail - head) <= 0)
 	{
 		return 0;
 	}
 
-	//Protect remove_index and current_size
-	mutex_lock(&kernel_lock);
+	return min_t(u64, tail - head, ring->capacity);
+}
+
 
-	long ts = pRBuffer[remove_index].timestamp;
-	pRBuffer[remove_index].timestamp = 0;
+void RBuffer_Destroy(struct RBufferQueue* pQueue)
+{
+	int cpu;
 
-	if ( remove_index +1 >= MAX_SIZE)
+	if (pQueue->local)
 	{
-		remove_index = 0;
+		for_each_possible_cpu(cpu)
+		{
+			RBuffer_RingFree(per_cpu_ptr(pQueue->local, cpu));
+		}
+		free_percpu(pQueue->local);
+		pQueue->local = NULL;
 	}
-	else
+
+	RBuffer_RingFree(&pQueue->shared);
+}
+
+/*
+The capacity is rounded up to a power of two and applies to every ring.
+The per-CPU rings are never mappable: user space cannot honour the
+single-producer rule and would not see their contents anyway.
+*/
+int RBuffer_Create(struct RBufferQueue* pQueue, u32 capacity, bool percpu, bool mappable)
+{
+	int cpu;
+
+	memset(pQueue, 0, sizeof(*pQueue));
+
+	if (capacity < RBUFFER_MIN_CAPACITY || capacity > RBUFFER_MAX_CAPACITY)
+	{
+		return -EINVAL;
+	}
+	capacity = roundup_pow_of_two(capacity);
+
+	if (RBuffer_RingInit(&pQueue->shared, capacity, NUMA_NO_NODE, mappable))
 	{
-		remove_index++;
+		return -ENOMEM;
 	}
 
-	current_size--;
+	if (!percpu)
+	{
+		return 0;
+	}
 
-	mutex_unlock(&kernel_lock);
+	pQueue->local = alloc_percpu(struct RBufferRing);
+	if (!pQueue->local)
+	{
+		RBuffer_Destroy(pQueue);
+		return -ENOMEM;
+	}
 
-	return ts;
+	for_each_possible_cpu(cpu)
+	{
+		if (RBuffer_RingInit(per_cpu_ptr(pQueue->local, cpu), capacity, cpu_to_node(cpu), false))
+		{
+			RBuffer_Destroy(pQueue);
+			return -ENOMEM;
+		}
+	}
 
+	return 0;
+}
 
-int RBuffer_Size(void)
+void RBuffer_Init(struct RBufferQueue* pQueue)
 {
-	return current_size;
+	int cpu;
+
+	RBuffer_RingReset(&pQueue->shared);
+
+	if (pQueue->local)
+	{
+		for_each_possible_cpu(cpu)
+		{
+			RBuffer_RingReset(per_cpu_ptr(pQueue->local, cpu));
+		}
+	}
 }
 
-int RBuffer_Index(void)
+/*
+Batch producers stamp a whole batch with one clock read and come in here.
+*/
+int RBuffer_InsertToken(struct RBufferQueue* pQueue, const struct RBufferToken* token)
 {
-	return current_index;
+	int ret;
+
+	if (pQueue->local)
+	{
+		//Only this CPU produces into its ring while preemption is off
+		ret = RBuffer_RingPush(get_cpu_ptr(pQueue->local), token, true, pQueue->seqno);
+		put_cpu_ptr(pQueue->local);
+
+		if (ret == 0)
+		{
+			return 0;
+		}
+	}
+
+	return RBuffer_RingPush(&pQueue->shared, token, false, pQueue->seqno);
 }
 
-void RBuffer_ShowContents(struct RBuffer* pRBuffer)
+int RBuffer_Insert(struct RBufferQueue* pQueue, long value)
 {
-	int i;
-	printk("\n\n");
-	for (i = 0; i < MAX_SIZE; i++)
+	struct RBufferToken token = { .value = value, .enqueued = ktime_get_ns(), .seqno = 0 };
+
+	return RBuffer_InsertToken(pQueue, &token);
+}
+
+/*
+Returns 0 and fills in token, or 1 when every ring is empty.
+*/
+int RBuffer_TryRemove(struct RBufferQueue* pQueue, struct RBufferToken* token)
+{
+	int this_cpu = -1, cpu;
+
+	if (pQueue->local)
+	{
+		this_cpu = raw_smp_processor_id();
+
+		if (RBuffer_RingPop(per_cpu_ptr(pQueue->local, this_cpu), token) == 0)
+		{
+			return 0;
+		}
+	}
+
+	if (RBuffer_RingPop(&pQueue->shared, token) == 0)
+	{
+		return 0;
+	}
+
+	if (pQueue->local)
+	{
+		for_each_possible_cpu(cpu)
+		{
+			if (cpu != this_cpu &&
+				RBuffer_RingPop(per_cpu_ptr(pQueue->local, cpu), token) == 0)
+			{
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+long RBuffer_Remove(struct RBufferQueue* pQueue)
+{
+	struct RBufferToken token;
+
+	if (RBuffer_TryRemove(pQueue, &token))
+	{
+		return 0;
+	}
+
+	return token.value;
+}
+
+/*
+Insert, making room by throwing away the oldest token when the queue is
+full.  Returns how many tokens had to go, or -1 if the token itself could
+not be placed (only when user space keeps the mapped ring busy).
+*/
+int RBuffer_InsertOverwrite(struct RBufferQueue* pQueue, const struct RBufferToken* token)
+{
+	struct RBufferToken old;
+	int overwritten = 0, spins = 0;
+
+	while (RBuffer_InsertToken(pQueue, token))
 	{
-		printk(" Value = %ld Index = %d  current index = %d remove index = %d "
-			"size = %d\n", pRBuffer[i].timestamp, i, current_index, remove_index, current_size);
+		if (RBuffer_TryRemove(pQueue, &old) == 0)
+		{
+			overwritten++;
+		}
+
+		if (++spins > RBUFFER_SPIN_LIMIT)
+		{
+			return -1;
+		}
 	}
+
+	return overwritten;
 }
 
+int RBuffer_Size(struct RBufferQueue* pQueue)
+{
+	int cpu, size;
+
+	size = RBuffer_RingSize(&pQueue->shared);
+
+	if (pQueue->local)
+	{
+		for_each_possible_cpu(cpu)
+		{
+			size += RBuffer_RingSize(per_cpu_ptr(pQueue->local, cpu));
+		}
+	}
+
+	return size;
+}
+
+/*
+Cheaper than RBuffer_Size() == 0 with per-CPU rings: stops at the first
+ring that holds something.  Used as the wait condition of blocked readers.
+*/
+bool RBuffer_IsEmpty(struct RBufferQueue* pQueue)
+{
+	int cpu;
+
+	if (RBuffer_RingSize(&pQueue->shared))
+	{
+		return false;
+	}
+
+	if (pQueue->local)
+	{
+		for_each_possible_cpu(cpu)
+		{
+			if (RBuffer_RingSize(per_cpu_ptr(pQueue->local, cpu)))
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+Room for at least one more insert from this CPU.  Inserts fall back to the
+shared ring, so only the local ring of the current CPU matters.
+*/
+bool RBuffer_IsFull(struct RBufferQueue* pQueue)
+{
+	if (RBuffer_RingSize(&pQueue->shared) < pQueue->shared.capacity)
+	{
+		return false;
+	}
+
+	if (pQueue->local &&
+		RBuffer_RingSize(per_cpu_ptr(pQueue->local, raw_smp_processor_id())) < pQueue->shared.capacity)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+//Readers and writers may arm at the same time, so set bits instead of storing
+static void RBuffer_SetFlag(struct RBufferQueue* pQueue, u32 flag)
+{
+	u32* flags = &pQueue->shared.ctrl->flags;
+	u32 old = READ_ONCE(*flags);
+
+	//A full barrier whether or not the bit was set already
+	while (cmpxchg(flags, old, old | flag) != old)
+	{
+		old = READ_ONCE(*flags);
+	}
+	smp_mb();
+}
+
+/*
+Consumer side of the doorbell protocol: advertise that we are about to
+sleep, then look again.  Either the producer sees the flag after its
+publish and rings, or we see its token here.
+*/
+bool RBuffer_ArmWakeup(struct RBufferQueue* pQueue)
+{
+	RBuffer_SetFlag(pQueue, RBUFFER_NEED_WAKEUP);
+
+	return !RBuffer_IsEmpty(pQueue);
+}
+
+//Same for a producer waiting for a consumer to make room
+bool RBuffer_ArmSpace(struct RBufferQueue* pQueue)
+{
+	RBuffer_SetFlag(pQueue, RBUFFER_NEED_SPACE);
+
+	return !RBuffer_IsFull(pQueue);
+}
+
+void RBuffer_ClearWakeup(struct RBufferQueue* pQueue)
+{
+	WRITE_ONCE(pQueue->shared.ctrl->flags, 0);
+}
+
+int RBuffer_Index(struct RBufferQueue* pQueue)
+{
+	return READ_ONCE(pQueue->shared.ctrl->tail) & pQueue->shared.mask;
+}
+
+void RBuffer_ShowContents(struct RBufferQueue* pQueue)
+{
+	struct RBufferRing* ring = &pQueue->shared;
+	u64 pos, head = ring->ctrl->head, tail = ring->ctrl->tail;
+
+	printk("\n\n capacity = %u head = %llu tail = %llu size = %d\n",
+		ring->capacity, head, tail, RBuffer_Size(pQueue));
+
+	//Rings can be huge, only show the front of the queue
+	for (pos = head; pos != tail && pos - head < RBUFFER_SHOW_MAX; pos++)
+	{
+		printk(" Value = %ld Index = %llu  sequence = %llu seqno = %llu\n",
+			ring->slots[pos & ring->mask].timestamp, pos & ring->mask,
+			ring->slots[pos & ring->mask].sequence, ring->slots[pos & ring->mask].seqno);
+	}
+}
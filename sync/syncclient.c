@@ -1,167 +1,1349 @@
 //syncclient.c
-//#gcc -o sycclient syncclient.c -pthread
+//#gcc -O2 -o syncclient syncclient.c -pthread
+//
+//Throughput/latency benchmark for /dev/syncdevice.
+//
+//  ./syncclient                        3 producers, 3 consumers, 10 tokens, ASCII
+//  ./syncclient -b -p 4 -c 4 -n 1000000 -o json
+//  ./syncclient -m -p 2 -c 2 -t 10 -w 2 -a -o csv
+//  ./syncclient -u -Q 16 -B 64 -p 4 -c 4 -n 1000000
+//
+//  -b / -m      binary read()/write() (readers get records) / mmap()ed ring
+//  -u           binary batches through io_uring commands instead of read()/write()
+//  -Q N         io_uring commands in flight per thread (default 8, max 64)
+//  -d path      device node, default /dev/syncdevice
+//  -p N / -c N  producer / consumer threads
+//  -n N         stop after N tokens, or
+//  -t sec       produce for sec seconds instead
+//  -w sec       warmup: tokens consumed during the first sec seconds are not counted
+//  -B N         tokens a writer claims and writes at once, and per read() in
+//               binary mode (max 1024)
+//  -a           pin thread i to CPU i % ncpus, or
+//  -C list      pin threads round robin over a CPU list like 0,2,4-7
+//  -P policy    what the device does when full: block, eagain, overwrite or drop
+//  -o fmt       text (default), json or csv
+//  -q           no per-token log lines, only the result
+//  -V           with -b or -u and -n: check the device's sequence numbers, every token
+//               must come out exactly once or be counted as a gap
+//
+//Latency is enqueue (stamped by the device or the mapped producer) to
+//dequeue in the consumer, so it is only available with -b, -u and -m.
+
+#define _GNU_SOURCE
 
 #include<stdio.h>
+#include<stdlib.h>
 #include<unistd.h>
 #include<sys/types.h>
 #include<sys/stat.h>
 #include<fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
-#include <linux/rtc.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "syncdevice.h"
 
 #define DEVICE_NAME "/dev/syncdevice"
-#define REALTIMECLOCK "/dev/rtc"
 #define THREAD_COUNT 3
 #define TOKEN_MAX 10
-#define TIMEFRAME 1//1 second
+#define TIMEFRAME 1//us to back off on a full queue, the timer slack stretches it to ~50us
+#define IDLE_TIMEOUT 1000//ms without tokens before a reader gives up
+#define POLL_TIMEOUT 10//ms between checks whether the producers are done
+#define BATCH 8//tokens per read()/write() in binary mode
+#define BATCH_MAX 1024
+#define MAX_THREADS 256
+#define DEPTH 8//io_uring commands in flight per thread
+#define DEPTH_MAX 64
+#define LOG_BUFFER 16384//bytes of log lines a thread collects before one fwrite()
 
-static int fd = 0, rtc_device = 0;
-static int token = 1;
-pthread_mutex_t _mutex;
+//Log-linear latency buckets, same layout as the device's lathist.h
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
 
-//echo 42 > /dev/char_device
-void* write_thread(void* data)
+enum output { OUT_TEXT, OUT_JSON, OUT_CSV };
+
+//Benchmark configuration, filled in from the command line
+static struct
 {
-    struct rtc_time rtc_tm;
+    const char* device;
+    int producers;
+    int consumers;
+    long tokens;        //0: run for duration seconds instead
+    double duration;
+    double warmup;
+    int batch;
+    int pin;
+    int cpus[MAX_THREADS];
+    int ncpus;
+    enum output output;
+    int policy;         //-1: leave the device alone
+    int verify;
+    int depth;
+    int quiet;
+} cfg = { DEVICE_NAME, THREAD_COUNT, THREAD_COUNT, TOKEN_MAX, 0, 0, BATCH, 0, { 0 }, 0, OUT_TEXT, -1, 0, DEPTH, 0 };
 
-    int ret=0;
-    char buff[100], timestamp[100];
+static const char* const policies[] = { "block", "eagain", "overwrite", "drop" };
+
+//What a consumer measured, merged by main() at the end
+struct consumer_stats
+{
+    uint64_t consumed;
+    uint64_t last_ns;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+static int fd = 0, rfd = 0;
+static long token = 1;                  //Next token to hand out, taken with a fetch-add
+static int binary = 0;
+static int mapped = 0;
+static int uring = 0;
+
+static volatile int stop = 0;           //Duration mode: producers stop claiming tokens
+static volatile int producers_done = 0; //Consumers drain and leave once this is set
+static uint64_t measure_start;          //End of the warmup
+
+static struct consumer_stats stats[MAX_THREADS];
+
+//-V: times each sequence number after seq_base came out, one byte apiece
+static unsigned char* seq_seen;
+static uint64_t seq_base;
+static uint64_t seq_foreign;
+
+//What -V found, next to the device's own gap count for the run
+struct seq_check
+{
+    uint64_t missing;
+    uint64_t duplicate;
+    uint64_t foreign;   //Numbers outside the run, someone else writes here too
+};
 
-    int p = (int)data;
+//Same clock the device stamps tokens with, and no system call thanks to the vDSO
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    pthread_mutex_lock(&_mutex);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    while(token <= TOKEN_MAX)
+static unsigned hist_bucket(uint64_t ns)
+{
+    unsigned msb;
+
+    if (ns < (1 << HIST_SUB_BITS))
     {
-        memset(buff,0, 100);
-        memset(timestamp,0, 100);
+        return ns;
+    }
+
+    msb = 63 - __builtin_clzll(ns);
+
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+        ((ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t hist_floor(unsigned bucket)
+{
+    unsigned msb;
+
+    if (bucket < (1 << HIST_SUB_BITS))
+    {
+        return bucket;
+    }
+
+    msb = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+
+    return (1ULL << msb) +
+        ((uint64_t)(bucket & ((1 << HIST_SUB_BITS) - 1)) << (msb - HIST_SUB_BITS));
+}
+
+//Count a token a consumer got at now, unless we are still warming up
+static void account(struct consumer_stats* st, uint64_t now, uint64_t enqueue_ns)
+{
+    if (now < measure_start)
+    {
+        return;
+    }
+
+    st->consumed++;
+    st->last_ns = now;
+    if (enqueue_ns)
+    {
+        st->hist[hist_bucket(now - enqueue_ns)]++;
+    }
+}
+
+//No lock: every consumer bumps its own byte
+static void check_seqno(uint64_t seqno)
+{
+    if (seqno > seq_base && seqno - seq_base <= (uint64_t)cfg.tokens)
+    {
+        __atomic_fetch_add(&seq_seen[seqno - seq_base - 1], 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(&seq_foreign, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+   Hand out up to want consecutive token numbers starting at *first.
+   Returns how many were claimed, 0 once the run is over.  One fetch-add
+   per batch and no lock; the counter may run past cfg.tokens, whoever
+   gets a range beyond the end just gets less or nothing.
+   */
+static int claim_tokens(int want, long* first)
+{
+    long left;
+
+    if (stop)
+    {
+        return 0;
+    }
+
+    *first = __atomic_fetch_add(&token, want, __ATOMIC_RELAXED);
+    if (cfg.tokens == 0)
+    {
+        return want;
+    }
+
+    left = cfg.tokens + 1 - *first;
+
+    return left <= 0 ? 0 : left < want ? left : want;
+}
+
+/*
+   Per-thread log buffer.  printf() takes the stdout lock for every line,
+   which serializes the threads we are trying to measure, so lines are
+   collected here and written out LOG_BUFFER bytes at a time.  -q skips
+   them altogether.
+   */
+static __thread char log_buf[LOG_BUFFER];
+static __thread size_t log_len;
+
+static void log_flush(void)
+{
+    if (log_len)
+    {
+        fwrite(log_buf, 1, log_len, stdout);
+        log_len = 0;
+    }
+}
+
+static void __attribute__((format(printf, 1, 2))) log_line(const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (cfg.quiet)
+    {
+        return;
+    }
+
+    va_start(ap, fmt);
+    n = vsnprintf(log_buf + log_len, LOG_BUFFER - log_len, fmt, ap);
+    va_end(ap);
+
+    if (n >= 0 && (size_t)n >= LOG_BUFFER - log_len)
+    {
+        log_flush();
+        va_start(ap, fmt);
+        n = vsnprintf(log_buf, LOG_BUFFER, fmt, ap);
+        va_end(ap);
+        if (n >= LOG_BUFFER)
+        {
+            n = LOG_BUFFER - 1;
+        }
+    }
+
+    if (n > 0)
+    {
+        log_len += n;
+    }
+}
+
+//Thread i runs on cfg.cpus[i % ncpus], or CPU i % online CPUs with -a
+static void pin_thread(int i)
+{
+    cpu_set_t set;
+    long online;
+
+    if (!cfg.pin)
+    {
+        return;
+    }
+
+    CPU_ZERO(&set);
+    if (cfg.ncpus)
+    {
+        CPU_SET(cfg.cpus[i % cfg.ncpus], &set);
+    }
+    else
+    {
+        online = sysconf(_SC_NPROCESSORS_ONLN);
+        CPU_SET(i % (online > 0 ? online : 1), &set);
+    }
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    {
+        printf("Unable to pin thread %d.\n", i);
+    }
+}
+
+//The shared ring of the device, see syncdevice.h for the protocol
+static struct
+{
+    uint8_t* base;
+    uint64_t* head;
+    uint64_t* tail;
+    uint32_t* flags;
+    uint8_t* slots;
+    struct sync_ring_info info;
+} ring;
+
+static int ring_map(void)
+{
+    if (ioctl(fd, SYNC_IOC_RING_INFO, &ring.info))
+    {
+        return -1;
+    }
+
+    ring.base = mmap(NULL, ring.info.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring.base == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    ring.head = (uint64_t*)(ring.base + ring.info.head_off);
+    ring.tail = (uint64_t*)(ring.base + ring.info.tail_off);
+    ring.flags = (uint32_t*)(ring.base + ring.info.flags_off);
+    ring.slots = ring.base + ring.info.slots_off;
+
+    return 0;
+}
+
+static struct sync_slot* ring_slot(uint64_t pos)
+{
+    return (struct sync_slot*)(ring.slots + (pos & (ring.info.capacity - 1)) * ring.info.slot_size);
+}
 
-        sprintf(buff,"%d",token);
-        ret = write(fd,buff, 5);
+//Returns 0 once the token is published, -1 when the ring is full
+static int ring_push(sync_token_t value)
+{
+    struct sync_slot* slot;
+    uint64_t pos = __atomic_load_n(ring.tail, __ATOMIC_RELAXED);
+    int64_t dif;
+
+    for (;;)
+    {
+        slot = ring_slot(pos);
+        dif = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
 
-        /* Read the RTC time/date */
-        if( rtc_device != -1)
+        if (dif == 0)
         {
+            if (__atomic_compare_exchange_n(ring.tail, &pos, pos + 1, 0,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(ring.tail, __ATOMIC_RELAXED);
+        }
+    }
 
-            memset ( &rtc_tm, 0, sizeof( struct rtc_time));
-            ioctl(rtc_device, RTC_RD_TIME, &rtc_tm);
+    slot->token = value;
+    slot->enqueue_ns = now_ns();
+    slot->seqno = 0;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
 
-            /* print out the time from the rtc_tm variable */
-            sprintf(timestamp, "%02d:%02d:%02d", rtc_tm.tm_hour, rtc_tm.tm_min, rtc_tm.tm_sec);
+    //Only pay for a system call when a consumer went to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(ring.flags, __ATOMIC_RELAXED) & SYNC_RING_NEED_WAKEUP)
+    {
+        ioctl(fd, SYNC_IOC_DOORBELL);
+    }
+
+    return 0;
+}
+
+//Returns 0 and the token in record, -1 when the ring is empty
+static int ring_pop(struct sync_record* record)
+{
+    struct sync_slot* slot;
+    uint64_t pos = __atomic_load_n(ring.head, __ATOMIC_RELAXED);
+    int64_t dif;
+
+    for (;;)
+    {
+        slot = ring_slot(pos);
+        dif = (int64_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (pos + 1));
+
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(ring.head, &pos, pos + 1, 0,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(ring.head, __ATOMIC_RELAXED);
         }
-        printf("write_thread()::thread ID: %d Token = %s Timestamp = %s\n",p, buff, timestamp);
+    }
 
-        //pthread_mutex_lock(&_mutex);
+    record->token = slot->token;
+    record->enqueue_ns = slot->enqueue_ns;
+    record->seqno = slot->seqno;
+    __atomic_store_n(&slot->sequence, pos + ring.info.capacity, __ATOMIC_RELEASE);
 
-        token++;
+    //A writer blocked in the kernel is waiting for this slot
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(ring.flags, __ATOMIC_RELAXED) & SYNC_RING_NEED_SPACE)
+    {
+        ioctl(fd, SYNC_IOC_DOORBELL);
+    }
 
-        pthread_mutex_unlock(&_mutex);
+    return 0;
+}
+
+/*
+   Consumers sleep in poll() but wake up every POLL_TIMEOUT to notice the
+   end of the run.  producers_done is sampled before the queue is found
+   empty, so nothing can still be on its way once we leave.
+   */
+static int consumer_wait(struct pollfd* pfd, int done)
+{
+    if (done)
+    {
+        return -1;
+    }
+
+    return poll(pfd, 1, POLL_TIMEOUT) < 0 ? -1 : 0;
+}
+
+//Mapped mode: no read()/write() at all, the ring is driven from here
+void* write_thread_mapped(void* data)
+{
+    long first, value;
+    int n;
+    int p = (int)(long)data;
 
-        usleep(TIMEFRAME);
+    pin_thread(p - 1);
 
-        pthread_mutex_lock(&_mutex);
+    while ((n = claim_tokens(cfg.batch, &first)) > 0)
+    {
+        for (value = first; value < first + n; value++)
+        {
+            while (ring_push(value))
+            {
+                //Ring full, let the readers catch up
+                usleep(TIMEFRAME);
+            }
+        }
+        log_line("write_thread()::thread ID: %d Tokens = %ld..%ld\n", p, first, first + n - 1);
     }
 
-    pthread_mutex_unlock(&_mutex);
+    log_flush();
+    pthread_exit(NULL);
+}
+
+void* read_thread_mapped(void* data)
+{
+    int c = (int)(long)data;
+    struct consumer_stats* st = &stats[c];
+    struct sync_record record;
+    struct pollfd pfd = { .fd = rfd, .events = POLLIN };
+    int done;
+
+    pin_thread(cfg.producers + c);
+
+    for (;;)
+    {
+        done = producers_done;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (ring_pop(&record) == 0)
+        {
+            account(st, now_ns(), record.enqueue_ns);
+            log_line("read_thread()::Token : %lld\n", (long long)record.token);
+            continue;
+        }
 
+        //Empty: sleep in the kernel until a producer rings the doorbell
+        if (consumer_wait(&pfd, done))
+        {
+            break;
+        }
+    }
+
+    log_flush();
+    pthread_exit(NULL);
+}
+
+/*
+   io_uring without liburing: one ring per thread, set up by hand.  The SQ
+   array maps entry i to SQE i once and for all, so submitting is filling
+   SQEs and moving the tail.
+   */
+struct uring
+{
+    int fd;
+    unsigned entries;
+    unsigned* sq_tail;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_size;
+    size_t cq_size;
+};
+
+static int uring_init(struct uring* u, unsigned entries)
+{
+    struct io_uring_params p;
+    unsigned* array;
+    unsigned i;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+    {
+        return -1;
+    }
+
+    u->entries = p.sq_entries;
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP && u->cq_size > u->sq_size)
+    {
+        u->sq_size = u->cq_size;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+            IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    u->cq_ring = u->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        u->cq_ring = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+        {
+            return -1;
+        }
+    }
+
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    u->sq_tail = (unsigned*)((uint8_t*)u->sq_ring + p.sq_off.tail);
+    array = (unsigned*)((uint8_t*)u->sq_ring + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++)
+    {
+        array[i] = i;
+    }
+
+    u->cq_head = (unsigned*)((uint8_t*)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned*)((uint8_t*)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned*)((uint8_t*)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)((uint8_t*)u->cq_ring + p.cq_off.cqes);
+
+    return 0;
+}
+
+static void uring_exit(struct uring* u)
+{
+    munmap(u->sqes, u->entries * sizeof(struct io_uring_sqe));
+    if (u->cq_ring != u->sq_ring)
+    {
+        munmap(u->cq_ring, u->cq_size);
+    }
+    munmap(u->sq_ring, u->sq_size);
+    close(u->fd);
+}
+
+//Queue the i-th SQE of this round as a syncdevice command on dev
+static void uring_prep(struct uring* u, unsigned i, int dev, unsigned op, void* addr, unsigned count,
+        unsigned flags, uint64_t user_data)
+{
+    struct io_uring_sqe* sqe = &u->sqes[(*u->sq_tail + i) & (u->entries - 1)];
+    struct sync_uring_cmd* cmd = (struct sync_uring_cmd*)sqe->cmd;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = dev;
+    sqe->cmd_op = op;
+    sqe->user_data = user_data;
+    cmd->addr = (uint64_t)(uintptr_t)addr;
+    cmd->count = count;
+    cmd->flags = flags;
+}
+
+//Submit n prepared SQEs and wait for all of them in one system call
+static int uring_submit_wait(struct uring* u, unsigned n)
+{
+    int ret;
+
+    __atomic_store_n(u->sq_tail, *u->sq_tail + n, __ATOMIC_RELEASE);
+
+    do
+    {
+        ret = syscall(__NR_io_uring_enter, u->fd, n, n, IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -1 : 0;
+}
+
+//Returns 0 and the next completion, -1 when there is none
+static int uring_reap(struct uring* u, struct io_uring_cqe* cqe)
+{
+    unsigned head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return -1;
+    }
+
+    *cqe = u->cqes[head & u->cq_mask];
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+   io_uring mode: up to cfg.depth enqueue commands of a batch each per
+   system call.  A command that comes back short is resubmitted for the
+   rest in the next round.
+   */
+void* write_thread_uring(void* data)
+{
+    int p = (int)(long)data;
+    struct uring u;
+    struct io_uring_cqe cqe;
+    sync_token_t* buf;
+    int off[DEPTH_MAX] = { 0 }, left[DEPTH_MAX] = { 0 };
+    long first;
+    unsigned n;
+    int s, i, moved, claimed = 1;
+
+    pin_thread(p - 1);
+
+    buf = calloc((size_t)cfg.depth * cfg.batch, SYNC_TOKEN_SIZE);
+    if (!buf || uring_init(&u, cfg.depth))
+    {
+        printf("Unable to set up io_uring for producer %d.\n", p);
+        free(buf);
+        pthread_exit(NULL);
+    }
+
+    for (;;)
+    {
+        n = 0;
+        for (s = 0; s < cfg.depth; s++)
+        {
+            if (left[s] == 0 && claimed)
+            {
+                left[s] = claimed = claim_tokens(cfg.batch, &first);
+                off[s] = 0;
+                for (i = 0; i < left[s]; i++)
+                {
+                    buf[s * cfg.batch + i] = first + i;
+                }
+            }
+            if (left[s])
+            {
+                uring_prep(&u, n++, fd, SYNC_URING_ENQUEUE, &buf[s * cfg.batch + off[s]], left[s], 0, s);
+            }
+        }
+
+        if (n == 0 || uring_submit_wait(&u, n))
+        {
+            break;
+        }
+
+        moved = 0;
+        while (uring_reap(&u, &cqe) == 0)
+        {
+            s = (int)cqe.user_data;
+            if (cqe.res > 0)
+            {
+                off[s] += cqe.res;
+                left[s] -= cqe.res;
+                moved += cqe.res;
+            }
+            else if (cqe.res < 0 && cqe.res != -EAGAIN)
+            {
+                log_line("write_thread()::thread ID: %d enqueue failed: %s\n", p, strerror(-cqe.res));
+                left[s] = 0;
+            }
+        }
+
+        //Queue full, let the readers catch up
+        if (moved == 0)
+        {
+            usleep(TIMEFRAME);
+        }
+        log_line("write_thread()::thread ID: %d Tokens = %d\n", p, moved);
+    }
+
+    uring_exit(&u);
+    free(buf);
+
+    log_flush();
+    pthread_exit(NULL);
+}
+
+/*
+   cfg.depth non-blocking dequeue commands per system call.  When none of
+   them found a token the thread sleeps in poll() like the read() readers.
+   */
+void* read_thread_uring(void* data)
+{
+    int c = (int)(long)data;
+    struct consumer_stats* st = &stats[c];
+    struct uring u;
+    struct io_uring_cqe cqe;
+    struct sync_record* records;
+    struct pollfd pfd = { .fd = rfd, .events = POLLIN };
+    uint64_t now;
+    int s, i, got, done;
+
+    pin_thread(cfg.producers + c);
+
+    records = calloc((size_t)cfg.depth * cfg.batch, sizeof(struct sync_record));
+    if (!records || uring_init(&u, cfg.depth))
+    {
+        printf("Unable to set up io_uring for consumer %d.\n", c);
+        free(records);
+        pthread_exit(NULL);
+    }
+
+    for (;;)
+    {
+        done = producers_done;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        for (s = 0; s < cfg.depth; s++)
+        {
+            uring_prep(&u, s, rfd, SYNC_URING_DEQUEUE, &records[s * cfg.batch], cfg.batch,
+                    SYNC_URING_NOWAIT, s);
+        }
+        if (uring_submit_wait(&u, cfg.depth))
+        {
+            break;
+        }
+
+        now = now_ns();
+        got = 0;
+        while (uring_reap(&u, &cqe) == 0)
+        {
+            s = (int)cqe.user_data;
+            for (i = 0; i < cqe.res; i++)
+            {
+                account(st, now, records[s * cfg.batch + i].enqueue_ns);
+                if (seq_seen)
+                {
+                    check_seqno(records[s * cfg.batch + i].seqno);
+                }
+            }
+            if (cqe.res > 0)
+            {
+                got += cqe.res;
+            }
+        }
+        log_line("read_thread()::Tokens : %d\n", got);
+
+        if (got == 0 && consumer_wait(&pfd, done))
+        {
+            break;
+        }
+    }
+
+    uring_exit(&u);
+    free(records);
+
+    log_flush();
+    pthread_exit(NULL);
+}
+
+//Binary mode: claim up to a batch of tokens and push them with one write()
+void* write_thread_binary(void* data)
+{
+    sync_token_t batch[BATCH_MAX];
+    long first;
+    int i, n, ret;
+    int p = (int)(long)data;
+
+    pin_thread(p - 1);
+
+    while ((n = claim_tokens(cfg.batch, &first)) > 0)
+    {
+        for (i = 0; i < n; i++)
+        {
+            batch[i] = first + i;
+        }
+
+        for (i = 0; i < n; i += ret / SYNC_TOKEN_SIZE)
+        {
+            ret = write(fd, &batch[i], (n - i) * SYNC_TOKEN_SIZE);
+            if (ret < 0 && errno == EAGAIN)
+            {
+                //Queue full, let the readers catch up
+                usleep(TIMEFRAME);
+                ret = 0;
+            }
+            else if (ret < 0)
+            {
+                perror("write_thread()::write");
+                exit(EXIT_FAILURE);
+            }
+        }
+        log_line("write_thread()::thread ID: %d Tokens = %lld..%lld\n", p,
+                (long long)batch[0], (long long)batch[n - 1]);
+    }
+
+    log_flush();
+    pthread_exit(NULL);
+}
+
+//echo "42 43 44" > /dev/char_device, a batch of tokens per write()
+void* write_thread(void* data)
+{
+    int ret=0;
+    char buff[BATCH_MAX * 21 + 1];
+    size_t len, off;
+    long first;
+    int i, n;
+
+    int p = (int)(long)data;
+
+    pin_thread(p - 1);
+
+    while ((n = claim_tokens(cfg.batch, &first)) > 0)
+    {
+        len = 0;
+        for (i = 0; i < n; i++)
+        {
+            len += sprintf(buff + len, "%ld%c", first + i, i == n - 1 ? '\n' : ' ');
+        }
+
+        //The device takes what fits its bounce buffer and says how far it got
+        for (off = 0; off < len; off += ret)
+        {
+            ret = write(fd, buff + off, len - off);
+            if (ret < 0 && errno == EAGAIN)
+            {
+                ret = 0;
+                continue;
+            }
+            if (ret <= 0)
+            {
+                break;
+            }
+        }
+
+        log_line("write_thread()::thread ID: %d Tokens = %ld..%ld Timestamp = %llu ns\n", p,
+                first, first + n - 1, (unsigned long long)now_ns());
+    }
+
+    log_flush();
     pthread_exit(NULL);
 }
 
 //cat /dev/syncdevice
 void* read_thread(void* data)
 {
-    struct rtc_time rtc_tm;
-    int ret=0;
-    char buff[100], timestamp[100];
-    memset(buff,0, 100);
+    int c = (int)(long)data;
+    struct consumer_stats* st = &stats[c];
+    int i, ret=0, done;
+    char buff[100];
+    struct sync_record records[BATCH_MAX];
+    struct pollfd pfd = { .fd = rfd, .events = POLLIN };
+    uint64_t now;
 
-    //Returns 0 when there is nothing in the queue
-    while (ret=read(fd,buff,10) != 0 )
+    pin_thread(cfg.producers + c);
+
+    for (;;)
     {
-        buff[strlen(buff)]='\0';
-        memset(timestamp,0, 100);
+        done = producers_done;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        memset(buff,0, 100);
 
-        /* Read the RTC time/date */
-        if( rtc_device  != -1 )
+        //Another reader may have taken the token first
+        if (binary)
         {
-            memset ( &rtc_tm, 0, sizeof( struct rtc_time));
-            ioctl(rtc_device, RTC_RD_TIME, &rtc_tm);
+            ret = read(rfd, records, cfg.batch * sizeof(struct sync_record));
+        }
+        else
+        {
+            ret = read(rfd, buff, sizeof(buff) - 1);
+        }
 
-            /* print out the time from the rtc_tm variable */
-            sprintf(timestamp, "%02d:%02d:%02d", rtc_tm.tm_hour, rtc_tm.tm_min,
-                    rtc_tm.tm_sec);
+        if (ret < 0 && errno == EAGAIN)
+        {
+            if (consumer_wait(&pfd, done))
+            {
+                break;
+            }
+            continue;
+        }
+        if (ret <= 0)
+        {
+            break;
         }
 
+        now = now_ns();
 
-        printf("read_thread()::Token : %s Timestamp = %s\n",buff, timestamp);
-        usleep(TIMEFRAME);
+        //Binary readers get the enqueue time from the device with each token
+        if (binary)
+        {
+            for (i = 0; i < ret / (int)sizeof(struct sync_record); i++)
+            {
+                account(st, now, records[i].enqueue_ns);
+                if (seq_seen)
+                {
+                    check_seqno(records[i].seqno);
+                }
+                log_line("read_thread()::Token : %lld Latency = %llu ns\n", (long long)records[i].token,
+                        (unsigned long long)(now - records[i].enqueue_ns));
+            }
+        }
+        else
+        {
+            account(st, now, 0);
+            log_line("read_thread()::Token : %s Timestamp = %llu ns\n",buff,
+                    (unsigned long long)now);
+        }
     }
 
+    log_flush();
     pthread_exit(NULL);
 }
 
 
-int main()
+//"0,2,4-7" into cfg.cpus
+static int parse_cpus(const char* list)
 {
-    int i;
-    char timestamp[100];
-    int retval;
+    char* copy = strdup(list);
+    char* save = NULL;
+    char* part;
+    int lo, hi;
 
-    struct rtc_time rtc_tm;
+    cfg.ncpus = 0;
+    for (part = strtok_r(copy, ",", &save); part; part = strtok_r(NULL, ",", &save))
+    {
+        if (sscanf(part, "%d-%d", &lo, &hi) != 2)
+        {
+            hi = lo = atoi(part);
+        }
 
-    pthread_mutex_init(&_mutex,NULL);
+        for (; lo <= hi && cfg.ncpus < MAX_THREADS; lo++)
+        {
+            cfg.cpus[cfg.ncpus++] = lo;
+        }
+    }
+    free(copy);
 
-    fd=open(DEVICE_NAME,O_RDWR);
-    if( fd == -1)
+    return cfg.ncpus ? 0 : -1;
+}
+
+static void usage(const char* name)
+{
+    printf("usage: %s [-b|-m|-u [-Q depth]] [-d device] [-p producers] [-c consumers] [-n tokens | -t seconds]\n"
+            "       [-w warmup] [-B batch] [-a | -C cpulist] [-P block|eagain|overwrite|drop]\n"
+            "       [-o text|json|csv] [-V] [-q]\n", name);
+}
+
+static int parse_args(int argc, char** argv)
+{
+    int opt, counted = 0;
+
+    while ((opt = getopt(argc, argv, "bmuQ:d:p:c:n:t:w:B:aC:P:o:Vqh")) != -1)
     {
-        printf("Unable to open %s.\n", DEVICE_NAME );
-        return 1;
+        switch (opt)
+        {
+            case 'b': binary = 1; break;
+            case 'm': mapped = 1; break;
+            case 'u': uring = 1; break;
+            case 'Q': cfg.depth = atoi(optarg); break;
+            case 'V': cfg.verify = 1; break;
+            case 'q': cfg.quiet = 1; break;
+            case 'd': cfg.device = optarg; break;
+            case 'p': cfg.producers = atoi(optarg); break;
+            case 'c': cfg.consumers = atoi(optarg); break;
+            case 'n': cfg.tokens = atol(optarg); counted = 1; break;
+            case 't': cfg.duration = atof(optarg); break;
+            case 'w': cfg.warmup = atof(optarg); break;
+            case 'B': cfg.batch = atoi(optarg); break;
+            case 'a': cfg.pin = 1; break;
+            case 'C':
+                cfg.pin = 1;
+                if (parse_cpus(optarg))
+                {
+                    return -1;
+                }
+                break;
+            case 'P':
+                for (cfg.policy = 0; cfg.policy < 4; cfg.policy++)
+                {
+                    if (strcmp(optarg, policies[cfg.policy]) == 0)
+                    {
+                        break;
+                    }
+                }
+                if (cfg.policy == 4)
+                {
+                    return -1;
+                }
+                break;
+            case 'o':
+                if (strcmp(optarg, "json") == 0)
+                {
+                    cfg.output = OUT_JSON;
+                }
+                else if (strcmp(optarg, "csv") == 0)
+                {
+                    cfg.output = OUT_CSV;
+                }
+                else if (strcmp(optarg, "text") == 0)
+                {
+                    cfg.output = OUT_TEXT;
+                }
+                else
+                {
+                    return -1;
+                }
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    //-t without -n means a timed run
+    if (cfg.duration > 0 && !counted)
+    {
+        cfg.tokens = 0;
+    }
+    if (cfg.tokens == 0 && cfg.duration <= 0)
+    {
+        return -1;
+    }
+
+    if (binary + mapped + uring > 1 || cfg.depth < 1 || cfg.depth > DEPTH_MAX)
+    {
+        return -1;
     }
 
-    //RTC
-    rtc_device = open (REALTIMECLOCK, O_RDONLY);
-    if( rtc_device == -1)
+    //Only records carry numbers, and only a counted run knows which to expect
+    if (cfg.verify && (!(binary || uring) || cfg.tokens == 0))
     {
-        printf("Unable to open rtc_device. Try using 'sudo'.\n");
+        return -1;
     }
 
-    if( fd )
+    if (cfg.producers < 1 || cfg.consumers < 1 || cfg.producers + cfg.consumers > MAX_THREADS ||
+            cfg.batch < 1 || cfg.batch > BATCH_MAX)
     {
-        //Write threads
-        pthread_t write_threads[THREAD_COUNT];
+        return -1;
+    }
+
+    return 0;
+}
+
+static const char* mode_name(void)
+{
+    return mapped ? "mmap" : uring ? "io_uring" : binary ? "binary" : "ascii";
+}
 
-        for(i=0;i<THREAD_COUNT;i++)
+/*
+   Fold the consumers together and print one result.  Percentiles are
+   bucket floors, so they read at most 12.5% low.
+   */
+static void report(uint64_t end_ns, const struct sync_stats* lost, const struct seq_check* check)
+{
+    static const double pct[] = { 50.0, 99.0, 99.9 };
+    uint64_t hist[HIST_BUCKETS] = { 0 };
+    uint64_t total = 0, samples = 0, seen = 0, value[4] = { 0 };
+    double seconds, ops;
+    unsigned b, p = 0;
+    int c, latency = binary || mapped || uring;
+
+    for (c = 0; c < cfg.consumers; c++)
+    {
+        total += stats[c].consumed;
+        if (stats[c].last_ns > end_ns)
         {
-            pthread_create(&write_threads[i], NULL, write_thread, (void*)(i+1));
+            end_ns = stats[c].last_ns;
+        }
+        for (b = 0; b < HIST_BUCKETS; b++)
+        {
+            hist[b] += stats[c].hist[b];
+        }
+    }
 
+    for (b = 0; b < HIST_BUCKETS; b++)
+    {
+        samples += hist[b];
+    }
+
+    for (b = 0; b < HIST_BUCKETS && samples; b++)
+    {
+        seen += hist[b];
+        while (p < 3 && seen * 100.0 >= samples * pct[p])
+        {
+            value[p++] = hist_floor(b);
         }
+        if (hist[b])
+        {
+            value[3] = hist_floor(b);
+        }
+    }
+
+    seconds = end_ns > measure_start ? (end_ns - measure_start) / 1e9 : 0;
+    ops = seconds > 0 ? total / seconds : 0;
+
+    switch (cfg.output)
+    {
+        case OUT_JSON:
+            printf("{\"mode\": \"%s\", \"producers\": %d, \"consumers\": %d, \"batch\": %d, "
+                    "\"tokens\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.0f",
+                    mode_name(), cfg.producers, cfg.consumers, cfg.batch,
+                    (unsigned long long)total, seconds, ops);
+            if (latency)
+            {
+                printf(", \"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu",
+                        (unsigned long long)value[0], (unsigned long long)value[1],
+                        (unsigned long long)value[2], (unsigned long long)value[3]);
+            }
+            printf(", \"dropped\": %llu, \"overwritten\": %llu, \"blocked\": %llu",
+                    (unsigned long long)lost->dropped, (unsigned long long)lost->overwritten,
+                    (unsigned long long)lost->blocked);
+            if (check)
+            {
+                printf(", \"gaps\": %llu, \"missing\": %llu, \"duplicate\": %llu, \"foreign\": %llu",
+                        (unsigned long long)lost->gaps, (unsigned long long)check->missing,
+                        (unsigned long long)check->duplicate, (unsigned long long)check->foreign);
+            }
+            printf("}\n");
+            break;
+
+        case OUT_CSV:
+            printf("mode,producers,consumers,batch,tokens,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns,"
+                    "dropped,overwritten,blocked%s\n", check ? ",gaps,missing,duplicate,foreign" : "");
+            printf("%s,%d,%d,%d,%llu,%.6f,%.0f", mode_name(), cfg.producers, cfg.consumers,
+                    cfg.batch, (unsigned long long)total, seconds, ops);
+            if (latency)
+            {
+                printf(",%llu,%llu,%llu,%llu",
+                        (unsigned long long)value[0], (unsigned long long)value[1],
+                        (unsigned long long)value[2], (unsigned long long)value[3]);
+            }
+            else
+            {
+                printf(",,,,");
+            }
+            printf(",%llu,%llu,%llu", (unsigned long long)lost->dropped,
+                    (unsigned long long)lost->overwritten, (unsigned long long)lost->blocked);
+            if (check)
+            {
+                printf(",%llu,%llu,%llu,%llu", (unsigned long long)lost->gaps,
+                        (unsigned long long)check->missing, (unsigned long long)check->duplicate,
+                        (unsigned long long)check->foreign);
+            }
+            printf("\n");
+            break;
+
+        default:
+            printf("mode %s producers %d consumers %d batch %d: %llu tokens in %.3f s, %.0f ops/sec\n",
+                    mode_name(), cfg.producers, cfg.consumers, cfg.batch,
+                    (unsigned long long)total, seconds, ops);
+            if (latency)
+            {
+                printf("latency p50 %llu ns p99 %llu ns p999 %llu ns max %llu ns\n",
+                        (unsigned long long)value[0], (unsigned long long)value[1],
+                        (unsigned long long)value[2], (unsigned long long)value[3]);
+            }
+            printf("dropped %llu overwritten %llu blocked %llu\n", (unsigned long long)lost->dropped,
+                    (unsigned long long)lost->overwritten, (unsigned long long)lost->blocked);
+            if (check)
+            {
+                printf("seqno gaps %llu missing %llu duplicate %llu foreign %llu: %s\n",
+                        (unsigned long long)lost->gaps, (unsigned long long)check->missing,
+                        (unsigned long long)check->duplicate, (unsigned long long)check->foreign,
+                        check->missing == lost->gaps && !check->duplicate ? "ok" : "MISMATCH");
+            }
+            break;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    pthread_t threads[MAX_THREADS];
+    struct sync_stats before = { 0 }, after = { 0 };
+    struct seq_check check = { 0 };
+    uint64_t start;
+    long n;
+    int i, ret = 0;
 
-        //Read threads
-        //Wait for 3 seconds
-        usleep(TIMEFRAME * 3);
+    if (parse_args(argc, argv))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fd=open(cfg.device,O_RDWR);
+    if( fd == -1)
+    {
+        printf("Unable to open %s.\n", cfg.device );
+        return 1;
+    }
+
+    //Readers get their own non-blocking descriptor so poll() drives them
+    rfd=open(cfg.device,O_RDONLY | O_NONBLOCK);
+    if( rfd == -1)
+    {
+        printf("Unable to open %s.\n", cfg.device );
+        return 1;
+    }
+
+    //-m: produce and consume through the mmap()ed ring
+    if (mapped && ring_map())
+    {
+        printf("Unable to map the ring of %s.\n", cfg.device );
+        return 1;
+    }
 
-        pthread_t read_threads[THREAD_COUNT];
+    //-b, -u: use the binary batched ABI instead of ASCII, readers get records
+    if (binary || uring)
+    {
+        int mode = SYNC_MODE_BINARY, rmode = SYNC_MODE_RECORD;
 
-        for(i=0;i<THREAD_COUNT;i++)
+        if (ioctl(fd, SYNC_IOC_SET_MODE, &mode) || ioctl(rfd, SYNC_IOC_SET_MODE, &rmode))
         {
-            pthread_create(&read_threads[i], NULL, read_thread, NULL);
+            printf("Unable to switch %s to binary mode.\n", cfg.device );
+            return 1;
         }
+    }
 
-        //Wait all the threads
-        for(i=0;i<THREAD_COUNT;i++)
+    if (cfg.policy >= 0 && ioctl(fd, SYNC_IOC_SET_POLICY, &cfg.policy))
+    {
+        printf("Unable to set the %s policy on %s.\n", policies[cfg.policy], cfg.device );
+        return 1;
+    }
+
+    //The counters belong to the queue, only report what this run added
+    ioctl(fd, SYNC_IOC_GET_STATS, &before);
+
+    if (cfg.verify)
+    {
+        seq_base = before.seqno;
+        seq_seen = calloc(cfg.tokens, 1);
+        if (!seq_seen)
         {
-            pthread_join(write_threads[i], NULL);
-            pthread_join(read_threads[i], NULL);
+            printf("Out of memory for %ld sequence numbers.\n", cfg.tokens);
+            return 1;
+        }
+    }
 
+    start = now_ns();
+    measure_start = start + (uint64_t)(cfg.warmup * 1e9);
+
+    for(i=0;i<cfg.consumers;i++)
+    {
+        pthread_create(&threads[cfg.producers + i], NULL, mapped ? read_thread_mapped : uring ? read_thread_uring : read_thread,
+                (void*)(long)i);
+    }
+
+    for(i=0;i<cfg.producers;i++)
+    {
+        pthread_create(&threads[i], NULL, mapped ? write_thread_mapped : uring ? write_thread_uring :
+                binary ? write_thread_binary : write_thread, (void*)(long)(i+1));
+    }
+
+    //Timed run: the warmup comes on top of the measured duration
+    if (cfg.tokens == 0)
+    {
+        usleep((useconds_t)((cfg.warmup + cfg.duration) * 1e6));
+        stop = 1;
+    }
+
+    for(i=0;i<cfg.producers;i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    producers_done = 1;
+
+    for(i=0;i<cfg.consumers;i++)
+    {
+        pthread_join(threads[cfg.producers + i], NULL);
+    }
+
+    ioctl(fd, SYNC_IOC_GET_STATS, &after);
+    after.dropped -= before.dropped;
+    after.overwritten -= before.overwritten;
+    after.blocked -= before.blocked;
+    after.gaps -= before.gaps;
+
+    if (cfg.verify)
+    {
+        for (n = 0; n < cfg.tokens; n++)
+        {
+            if (seq_seen[n] == 0)
+            {
+                check.missing++;
+            }
+            else if (seq_seen[n] > 1)
+            {
+                check.duplicate += seq_seen[n] - 1;
+            }
         }
-        close(fd);
+        check.foreign = seq_foreign;
+        ret = check.missing != after.gaps || check.duplicate;
+        free(seq_seen);
     }
 
-    pthread_mutex_destroy(&_mutex);
-    pthread_exit(NULL);
+    report(measure_start, &after, cfg.verify ? &check : NULL);
 
-    close(rtc_device);
-}
+    if (mapped)
+    {
+        munmap(ring.base, ring.info.map_size);
+    }
+    close(rfd);
+    close(fd);
 
+    return ret;
+}
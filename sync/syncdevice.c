@@ -1,207 +1,1913 @@
-/*
-   ================================================================
-Name        : syncdevice.c
-Author      : 
-Version     :
-Copyright   : Your copyright notice
-Description : 
-================================================================
-*/
-
-#include <linux/module.h>
-#include <linux/init.h>
-#include <linux/kernel.h>
-#include <linux/spinlock.h>
-#include <linux/pci.h>
-#include <linux/fs.h>
-#include <linux/cdev.h>
-#include <asm/uaccess.h>
-#include <asm/io.h>
-
-#include "rbuffer.h"
-
-
-/*
-   cat /proc/devices | head -28 | tail -10
-   ls -l /dev | grep "250"
-   sudo mknod /dev/syncdevice c 250 0
-   sudo chmod 777 syncdevice
-   */
-
-#define DEVICE "syncdevice"
-#define DEVICE_NAME "syncdevice"
-
-static dev_t first; // Global variable for the first device number
-static struct cdev c_dev; // Global variable for the character device structure
-static struct class *cl; // Global variable for the device class
-
-static struct RBuffer* pQueue = 0;
-
-int stringToInt(char str[])
-{
-    int i=0,sum=0;
-
-    while(str[i]!='\0'){
-        if(str[i]< 48 || str[i] > 57){
-            printk("(sync device) Unable to convert it into integer.\n");
-            return 0;
-        }
-        else{
-            sum = sum*10 + (str[i] - 48);
-            i++;
-        }
-
-    }
-
-    return sum;
-
-}
-
-static int syncdevice_open(struct inode *i, struct file *f)
-{
-    printk("(sync device) open()\n");
-
-    //Reset the queue
-    if(pQueue)
-    {
-        RBuffer_Init(pQueue);
-        //RBuffer_ShowContents(pQueue);
-    }
-
-    return 0;
-}
-static int syncdevice_close(struct inode *i, struct file *f)
-{
-    printk("(sync device) close()\n");
-
-    return 0;
-}
-
-
-static ssize_t syncdevice_read(struct file *f, char __user *buf, size_t	len, loff_t *off)
-{
-    printk("(sync device) read()\n");
-
-    if( pQueue == 0 )
-    {
-        printk("(sync device) read() Queue does not exist.\n");
-        return 0;
-    }
-
-    int size = RBuffer_Size();
-    long token  = RBuffer_Remove(pQueue);
-    printk("(sync device) read() Queue size = %d token = %d\n", size, token);
-    char read_buffer[100];
-    memset(read_buffer, 0, 100);
-
-    if( token)
-    {
-        //unsigned long copy_to_user (void __user * to, const void * from, unsigned long n);
-        sprintf(read_buffer, "%d", token);
-        printk("(sync device) read() long value = %s %d\n", read_buffer, strlen(read_buffer));
-        copy_to_user(buf, read_buffer , strlen(read_buffer) );
-        return strlen(read_buffer);
-    }
-
-    return 0;
-}
-
-
-static ssize_t syncdevice_write(struct file *f, const char __user *buf, size_t len, loff_t *off)
-{
-    printk("(sync device) write()\n");
-
-    if( pQueue == 0 )
-    {
-        printk("(sync device) write() Queue does not exist.\n");
-        return 0;
-    }
-
-    int size = RBuffer_Size();
-    printk("(sync device) write() Queue size = %d, buffer = %s\n", size, buf);
-
-
-    long token = stringToInt(buf);
-    printk("(sync device) write long value = %ld\n", token);
-    if (token)
-    {
-        RBuffer_Insert(pQueue, token);
-    }
-
-    return len;
-}
-
-
-
-
-static struct file_operations syncdevice_fops =
-{
-    .owner = THIS_MODULE,
-    .open = syncdevice_open,
-    .release = syncdevice_close,
-    .write = syncdevice_write,
-    .read = syncdevice_read,
-};
-
-
-static int __init syncdevice_init(void)
-{
-    long deviceinfo;
-    int ret;
-
-    printk("(sync device) Module init()\n");
-
-    pQueue = kmalloc( (sizeof(struct RBuffer) * MAX_SIZE) , GFP_KERNEL );
-
-    //Register a range of char device numbers baseminor = 0, count = 1 name syncdevice
-    if (alloc_chrdev_region(&first, 0, 1, "syncdevice") < 0)
-    {
-        return -1;
-    }
-
-    //Create a struct class structure
-    if ((cl = class_create(THIS_MODULE, "chardrv")) == NULL)
-    {
-        unregister_chrdev_region(first, 1);
-        return -1;
-    }
-
-    if (device_create(cl, NULL, first, NULL, "syncdevice") == NULL)
-    {
-        class_destroy(cl);
-        unregister_chrdev_region(first, 1);
-        return -1;
-    }
-
-    cdev_init(&c_dev, &syncdevice_fops);
-
-    if (cdev_add(&c_dev, first, 1) == -1)
-    {
-        device_destroy(cl, first);
-        class_destroy(cl);
-        unregister_chrdev_region(first, 1);
-        return -1;
-    }
-
-    return 0;
-}
-
-static void __exit syncdevice_exit(void)
-{
-    printk("(sync device)Module exit.\n");
-
-    RBuffer_ShowContents(pQueue);
-
-    kfree(pQueue);
-    pQueue = 0;
-
-    cdev_del(&c_dev);
-    device_destroy(cl, first);
-    class_destroy(cl);
-    unregister_chrdev_region(first, 1);
-}
-
-module_init(syncdevice_init);
-module_exit(syncdevice_exit);
-
-MODULE_LICENSE("GPL");
+/*
+   ================================================================
+Name        : syncdevice.c
+Author      : 
+Version     :
+Copyright   : Your copyright notice
+Description : 
+================================================================
+*/
+
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/spinlock.h>
+#include <linux/pci.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/ctype.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/debugfs.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/io_uring/cmd.h>
+#include <asm/uaccess.h>
+#include <asm/io.h>
+
+#include "rbuffer.h"
+#include "broadcast.h"
+#include "lathist.h"
+#include "syncdevice.h"
+
+
+/*
+   cat /proc/devices | head -28 | tail -10
+   ls -l /dev | grep "250"
+   sudo mknod /dev/syncdevice c 250 0
+   sudo chmod 777 syncdevice
+
+   sudo insmod syncdevice.ko minors=4 creates /dev/syncdevice and
+   /dev/syncdevice1../dev/syncdevice3, each minor with its own queue.
+   */
+
+#define DEVICE "syncdevice"
+#define DEVICE_NAME "syncdevice"
+
+#define SYNC_MAX_MINORS 256
+
+static dev_t first; // Global variable for the first device number
+static struct cdev c_dev; // Global variable for the character device structure
+static struct class *cl; // Global variable for the device class
+
+/*
+   The rings behind a queue can be replaced by SYNC_IOC_SET_CAPACITY, so the
+   lock-free paths only touch them inside rcu_read_lock() and never sleep or
+   fault with the lock held: tokens are staged on the stack and copied to
+   or from user space outside of it.
+
+   rq is an array of SYNC_PRIORITIES lanes.  Lane 0 is the one that can be
+   mapped, so everything about the mapped ring only looks at rq[0].
+   */
+struct sync_queue
+{
+    struct RBufferQueue __rcu *rq;
+    wait_queue_head_t read_wait;    //Readers sleep here while the queue is empty
+    wait_queue_head_t write_wait;   //SYNC_POLICY_BLOCK writers sleep here while it is full
+    struct mutex lock;              //Serializes resizes against mmap
+    atomic_t opens;                 //Changed under lock, the last close drains the queue
+    atomic_t maps;                  //Live mappings pin the current rings
+    bool is_private;                //Belongs to a single open file, see SYNC_IOC_SET_PRIVATE
+    bool resizing;                  //Readers and writers stay off the rings while set, see syncdevice_set_capacity()
+    struct LatencyHist latency[SYNC_PRIORITIES];    //Enqueue to dequeue per lane, for tokens the kernel hands out
+    int policy;                     //SYNC_POLICY_*, what a write does when the queue is full
+    atomic64_t dropped;             //See struct sync_stats
+    atomic64_t overwritten;
+    atomic64_t blocked;
+    atomic64_t seqno;               //Last sequence number handed out, shared by every lane
+    atomic64_t gaps;                //Numbered tokens that were thrown away
+    unsigned long lanes;            //Lanes that ever got a token, readers skip the others
+    struct sync_sched sched;        //How readers pick a lane, changed under lock
+    atomic_t turn;                  //SYNC_SCHED_WEIGHTED position
+    struct Broadcast *bcast;        //Set once by SYNC_IOC_SET_BROADCAST, replaces the lanes
+};
+
+static struct dentry *sync_debugfs;
+
+static struct sync_queue *syncqs;   //One per minor
+
+static unsigned int minors = 1;
+module_param(minors, uint, 0444);
+MODULE_PARM_DESC(minors, "Number of /dev/syncdevice minors, each with its own queue");
+
+static bool percpu_rings = false;
+module_param(percpu_rings, bool, 0444);
+MODULE_PARM_DESC(percpu_rings, "Give every CPU a single-producer ring in front of the shared one");
+
+static unsigned int capacity = 128;
+module_param(capacity, uint, 0444);
+MODULE_PARM_DESC(capacity, "Tokens per ring, rounded up to a power of two");
+
+static unsigned int policy = SYNC_POLICY_BLOCK;
+module_param(policy, uint, 0444);
+MODULE_PARM_DESC(policy, "Initial full queue policy: 0 block, 1 eagain, 2 overwrite oldest, 3 drop newest");
+
+//Per open file state, hung off f->private_data
+struct sync_file
+{
+    int mode;   //SYNC_MODE_*
+    int priority;   //Lane of writes that do not carry their own
+    struct sync_queue *sq;  //The minor's queue, or a private one
+    struct BroadcastReader *reader; //Our cursor once the queue broadcasts
+};
+
+//Published with a release once it is set up, see syncdevice_set_broadcast()
+static struct Broadcast *syncdevice_bcast(struct sync_queue *sq)
+{
+    return smp_load_acquire(&sq->bcast);
+}
+
+//sf->sq changes once at most (SYNC_IOC_SET_PRIVATE), load it once per call
+static struct sync_queue *syncdevice_sq(struct file *f)
+{
+    return READ_ONCE(((struct sync_file *)f->private_data)->sq);
+}
+
+//Tokens moved per copy_{to,from}_user when a binary request is larger
+#define SYNC_BATCH 32
+
+
+//Lane 0 is allocated mappable, the others never get mapped
+static struct RBufferQueue *syncdevice_lanes_create(u32 size, atomic64_t *seqno)
+{
+    struct RBufferQueue *q;
+    int lane, ret;
+
+    q = kcalloc(SYNC_PRIORITIES, sizeof(*q), GFP_KERNEL);
+    if (!q)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        ret = RBuffer_Create(&q[lane], size, percpu_rings, lane == 0);
+        if (ret)
+        {
+            while (lane--)
+            {
+                RBuffer_Destroy(&q[lane]);
+            }
+            kfree(q);
+            return ERR_PTR(ret);
+        }
+        q[lane].seqno = seqno;
+    }
+
+    return q;
+}
+
+static void syncdevice_lanes_destroy(struct RBufferQueue *q)
+{
+    int lane;
+
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        RBuffer_Destroy(&q[lane]);
+    }
+    kfree(q);
+}
+
+static int syncdevice_queue_init(struct sync_queue *sq, u32 size, int full_policy)
+{
+    struct RBufferQueue *q;
+    int lane, ret;
+
+    q = syncdevice_lanes_create(size, &sq->seqno);
+    if (IS_ERR(q))
+    {
+        return PTR_ERR(q);
+    }
+
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        ret = LatencyHist_Init(&sq->latency[lane]);
+        if (ret)
+        {
+            while (lane--)
+            {
+                LatencyHist_Destroy(&sq->latency[lane]);
+            }
+            syncdevice_lanes_destroy(q);
+            return ret;
+        }
+    }
+
+    RCU_INIT_POINTER(sq->rq, q);
+    init_waitqueue_head(&sq->read_wait);
+    init_waitqueue_head(&sq->write_wait);
+    mutex_init(&sq->lock);
+    atomic_set(&sq->opens, 0);
+    atomic_set(&sq->maps, 0);
+    sq->policy = full_policy;
+    atomic64_set(&sq->dropped, 0);
+    atomic64_set(&sq->overwritten, 0);
+    atomic64_set(&sq->blocked, 0);
+    atomic64_set(&sq->seqno, 0);
+    atomic64_set(&sq->gaps, 0);
+
+    //Mapped producers can only fill lane 0
+    sq->lanes = BIT(0);
+    sq->sched.policy = SYNC_SCHED_STRICT;
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        sq->sched.weight[lane] = 1U << lane;
+    }
+    atomic_set(&sq->turn, 0);
+
+    return 0;
+}
+
+static void syncdevice_queue_exit(struct sync_queue *sq)
+{
+    int lane;
+
+    if (sq->bcast)
+    {
+        Broadcast_Destroy(sq->bcast);
+        kfree(sq->bcast);
+        sq->bcast = NULL;
+    }
+
+    syncdevice_lanes_destroy(rcu_dereference_protected(sq->rq, 1));
+    RCU_INIT_POINTER(sq->rq, NULL);
+
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        LatencyHist_Destroy(&sq->latency[lane]);
+    }
+}
+
+static void syncdevice_queue_free(struct sync_queue *sq)
+{
+    syncdevice_queue_exit(sq);
+    kfree(sq);
+}
+
+
+static int syncdevice_open(struct inode *i, struct file *f)
+{
+    struct sync_file *sf;
+
+    printk("(sync device) open()\n");
+
+    sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+    if (!sf)
+    {
+        return -ENOMEM;
+    }
+    sf->mode = SYNC_MODE_ASCII;
+    sf->sq = &syncqs[iminor(i) - MINOR(first)];
+    f->private_data = sf;
+
+    //Nothing on the read/write paths sleeps except where they check for nowait
+    f->f_mode |= FMODE_NOWAIT;
+
+    /*
+       Opening does not reset the queue: other pipelines on the same minor
+       may be in the middle of using it.  The last close drains it.
+       */
+    mutex_lock(&sf->sq->lock);
+    if (sf->sq->bcast)
+    {
+        sf->reader = kzalloc(sizeof(*sf->reader), GFP_KERNEL);
+        if (!sf->reader)
+        {
+            mutex_unlock(&sf->sq->lock);
+            kfree(sf);
+            return -ENOMEM;
+        }
+        Broadcast_Join(sf->sq->bcast, sf->reader);
+    }
+    atomic_inc(&sf->sq->opens);
+    mutex_unlock(&sf->sq->lock);
+
+    return 0;
+}
+
+static void syncdevice_queue_put(struct sync_queue *sq)
+{
+    if (sq->is_private)
+    {
+        syncdevice_queue_free(sq);
+        return;
+    }
+
+    mutex_lock(&sq->lock);
+    if (atomic_dec_and_test(&sq->opens))
+    {
+        struct RBufferQueue *q = rcu_dereference_protected(sq->rq, lockdep_is_held(&sq->lock));
+        int lane;
+
+        for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+        {
+            atomic64_add(RBuffer_Size(&q[lane]), &sq->gaps);
+            RBuffer_Init(&q[lane]);
+        }
+    }
+    mutex_unlock(&sq->lock);
+}
+
+static int syncdevice_close(struct inode *i, struct file *f)
+{
+    struct sync_file *sf = f->private_data;
+
+    printk("(sync device) close()\n");
+
+    //The slowest reader may be leaving, writers get to look again
+    if (sf->reader)
+    {
+        Broadcast_Leave(sf->sq->bcast, sf->reader);
+        kfree(sf->reader);
+        wake_up_interruptible_all(&sf->sq->write_wait);
+    }
+
+    syncdevice_queue_put(sf->sq);
+    kfree(sf);
+
+    return 0;
+}
+
+
+/*
+   Take a token from the lane the scheduler picks, inside rcu_read_lock().
+   Strict serves the most urgent non-empty lane.  Weighted gives lane i
+   weight[i] out of every sum(weight) turns off a shared counter, so readers
+   need no lock; a turn whose lane is empty falls back to strict.
+   Broadcast readers just follow their own cursor, everything is lane 0.
+   */
+static int syncdevice_pick(struct sync_queue *sq, struct BroadcastReader *reader, struct RBufferQueue *q,
+                           struct RBufferToken *token, int *lane)
+{
+    unsigned long lanes = READ_ONCE(sq->lanes);
+    u32 weight[SYNC_PRIORITIES], total = 0, turn;
+    int i;
+
+    if (reader)
+    {
+        *lane = 0;
+        return Broadcast_Read(sq->bcast, reader, &token->value, &token->enqueued, &token->seqno);
+    }
+
+    if (READ_ONCE(sq->resizing))
+    {
+        return 1;
+    }
+
+    if (READ_ONCE(sq->sched.policy) == SYNC_SCHED_WEIGHTED)
+    {
+        for (i = 0; i < SYNC_PRIORITIES; i++)
+        {
+            weight[i] = READ_ONCE(sq->sched.weight[i]);
+            total += weight[i];
+        }
+
+        if (total)
+        {
+            turn = (u32)atomic_inc_return(&sq->turn) % total;
+            for (i = SYNC_PRIORITIES - 1; turn >= weight[i]; i--)
+            {
+                turn -= weight[i];
+            }
+
+            if ((lanes & BIT(i)) && RBuffer_TryRemove(&q[i], token) == 0)
+            {
+                *lane = i;
+                return 0;
+            }
+        }
+    }
+
+    for (i = SYNC_PRIORITIES - 1; i >= 0; i--)
+    {
+        if ((lanes & BIT(i)) && RBuffer_TryRemove(&q[i], token) == 0)
+        {
+            *lane = i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int syncdevice_try_remove(struct sync_queue *sq, struct BroadcastReader *reader,
+                                 struct RBufferToken *token, int *lane)
+{
+    int ret;
+
+    rcu_read_lock();
+    ret = syncdevice_pick(sq, reader, rcu_dereference(sq->rq), token, lane);
+    rcu_read_unlock();
+
+    return ret;
+}
+
+static bool syncdevice_empty(struct sync_queue *sq, struct RBufferQueue *q)
+{
+    unsigned long lanes = READ_ONCE(sq->lanes);
+    int lane;
+
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        if ((lanes & BIT(lane)) && !RBuffer_IsEmpty(&q[lane]))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+   Only arm the doorbell flag of the mapped ring when we would otherwise
+   sleep, so user space producers do not ring for nothing.  Arming is a
+   full barrier, after it every lane is looked at again.
+   */
+static bool syncdevice_readable(struct sync_queue *sq, struct BroadcastReader *reader)
+{
+    struct RBufferQueue *q;
+    bool ret;
+
+    if (reader)
+    {
+        return Broadcast_HasData(sq->bcast, reader);
+    }
+
+    if (READ_ONCE(sq->resizing))
+    {
+        return false;
+    }
+
+    rcu_read_lock();
+    q = rcu_dereference(sq->rq);
+    ret = !syncdevice_empty(sq, q) || RBuffer_ArmWakeup(&q[0]) || !syncdevice_empty(sq, q);
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/*
+   Take one token, sleeping until there is one unless nonblock is set.
+   Waiters are exclusive so one insert wakes one reader
+   instead of all of them, except on a broadcast queue where every reader
+   wants every token.
+   */
+static int syncdevice_wait_token(struct file *f, struct RBufferToken *token, int *lane, bool nonblock)
+{
+    struct sync_queue *sq = syncdevice_sq(f);
+    struct BroadcastReader *reader = READ_ONCE(((struct sync_file *)f->private_data)->reader);
+    int ret;
+
+    while (syncdevice_try_remove(sq, reader, token, lane))
+    {
+        if (nonblock)
+        {
+            return -EAGAIN;
+        }
+
+        if (reader)
+        {
+            ret = wait_event_interruptible(sq->read_wait, syncdevice_readable(sq, reader));
+        }
+        else
+        {
+            ret = wait_event_interruptible_exclusive(sq->read_wait, syncdevice_readable(sq, NULL));
+        }
+
+        if (ret)
+        {
+            return -ERESTARTSYS;
+        }
+    }
+
+    return 0;
+}
+
+static void syncdevice_wake_readers(struct sync_queue *sq)
+{
+    //wq_has_sleeper() orders the insert against the reader's condition check
+    if (wq_has_sleeper(&sq->read_wait))
+    {
+        wake_up_interruptible_poll(&sq->read_wait, EPOLLIN | EPOLLRDNORM);
+    }
+}
+
+static bool syncdevice_writable(struct sync_queue *sq, int lane)
+{
+    struct Broadcast *bcast = syncdevice_bcast(sq);
+    struct RBufferQueue *q;
+    bool ret;
+
+    if (bcast)
+    {
+        return Broadcast_HasSpace(bcast);
+    }
+
+    if (READ_ONCE(sq->resizing))
+    {
+        return false;
+    }
+
+    rcu_read_lock();
+    q = &rcu_dereference(sq->rq)[lane];
+    ret = !RBuffer_IsFull(q) || RBuffer_ArmSpace(q);
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/*
+   SYNC_POLICY_BLOCK: sleep until there is room.  Every blocked writer is
+   woken when a reader makes room, one read can free a whole batch of slots.
+   Readers are kicked first, they may be waiting for what we already queued.
+   */
+static int syncdevice_wait_space(struct sync_queue *sq, int lane, bool nonblock)
+{
+    if (nonblock)
+    {
+        return -EAGAIN;
+    }
+
+    syncdevice_wake_readers(sq);
+    atomic64_inc(&sq->blocked);
+
+    if (wait_event_interruptible(sq->write_wait, syncdevice_writable(sq, lane)))
+    {
+        return -ERESTARTSYS;
+    }
+
+    return 0;
+}
+
+static void syncdevice_wake_writers(struct sync_queue *sq)
+{
+    if (wq_has_sleeper(&sq->write_wait))
+    {
+        wake_up_interruptible_poll(&sq->write_wait, EPOLLOUT | EPOLLWRNORM);
+    }
+}
+
+//A new token thrown away still uses up its number, so readers see the gap
+static void syncdevice_drop(struct sync_queue *sq)
+{
+    atomic64_inc(&sq->dropped);
+    atomic64_inc(&sq->seqno);
+    atomic64_inc(&sq->gaps);
+}
+
+/*
+   Publish to every reader of a broadcast queue.  The slowest reader is
+   what makes it full: overwrite skips it ahead instead of dropping the
+   oldest token for everyone.
+   */
+static int syncdevice_publish(struct sync_queue *sq, struct Broadcast *bcast, int full_policy,
+                              const struct RBufferToken *token)
+{
+    if (Broadcast_Publish(bcast, token->value, token->enqueued, &sq->seqno,
+                          full_policy == SYNC_POLICY_OVERWRITE) == 0)
+    {
+        return 0;
+    }
+
+    if (full_policy == SYNC_POLICY_DROP)
+    {
+        syncdevice_drop(sq);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+   Queue one token on a lane under the queue's policy, inside
+   rcu_read_lock().  Returns 0 when the token is done with (queued, or
+   accounted as lost), 1 when the caller has to wait or give up and
+   -EBUSY when the rings are being replaced, which every policy waits out.
+   */
+static int syncdevice_push(struct sync_queue *sq, struct RBufferQueue *q, int lane, int full_policy,
+                           const struct RBufferToken *token)
+{
+    struct Broadcast *bcast = syncdevice_bcast(sq);
+    int ret;
+
+    if (bcast)
+    {
+        return syncdevice_publish(sq, bcast, full_policy, token);
+    }
+
+    if (READ_ONCE(sq->resizing))
+    {
+        return -EBUSY;
+    }
+
+    //Readers skip lanes that never had a token, so mark it before inserting
+    if (!(READ_ONCE(sq->lanes) & BIT(lane)))
+    {
+        set_bit(lane, &sq->lanes);
+        smp_mb__after_atomic();
+    }
+    q = &q[lane];
+
+    switch (full_policy)
+    {
+        case SYNC_POLICY_OVERWRITE:
+            ret = RBuffer_InsertOverwrite(q, token);
+            if (ret > 0)
+            {
+                atomic64_add(ret, &sq->overwritten);
+                atomic64_add(ret, &sq->gaps);
+            }
+            else if (ret < 0)
+            {
+                syncdevice_drop(sq);
+            }
+            return 0;
+
+        case SYNC_POLICY_DROP:
+            if (RBuffer_InsertToken(q, token))
+            {
+                syncdevice_drop(sq);
+            }
+            return 0;
+
+        default:
+            return RBuffer_InsertToken(q, token);
+    }
+}
+
+
+//O_NONBLOCK on the file, or RWF_NOWAIT / IOCB_NOWAIT on this one call
+static bool syncdevice_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/*
+   Queueing delay of a token as of now.  Tokens queued after the caller
+   read the clock, and stamps stored by user space producers of the mapped
+   ring, which can be anything, would wrap around into the top bucket:
+   they count as no delay at all instead.
+   */
+static void syncdevice_record_latency(struct sync_queue *sq, int lane, u64 now, u64 enqueued)
+{
+    LatencyHist_Record(&sq->latency[lane], now > enqueued ? now - enqueued : 0);
+}
+
+/*
+   The read/write paths run concurrently on every CPU, so they only log
+   through pr_debug: a printk per token serializes everybody on the console.
+   They work on iov_iters, so read(), readv(), preadv2(), splice() and
+   io_uring commands all end up here.  nonblock says whether they may sleep.
+   */
+static ssize_t syncdevice_read_ascii(struct file *f, struct iov_iter *to, bool nonblock)
+{
+    struct RBufferToken token;
+    size_t n, len = iov_iter_count(to);
+    int ret, lane;
+    char read_buffer[24];
+
+    //Once taken off the queue a token cannot go back, so never cut one short
+    if (len < SYNC_ASCII_TOKEN_MAX)
+    {
+        return -EINVAL;
+    }
+
+    ret = syncdevice_wait_token(f, &token, &lane, nonblock);
+    if (ret)
+    {
+        return ret;
+    }
+    syncdevice_record_latency(syncdevice_sq(f), lane, ktime_get_ns(), token.enqueued);
+    syncdevice_wake_writers(syncdevice_sq(f));
+    pr_debug("(sync device) read() token = %ld\n", token.value);
+
+    n = snprintf(read_buffer, sizeof(read_buffer), "%ld", token.value);
+
+    if (copy_to_iter(read_buffer, n, to) != n)
+    {
+        atomic64_inc(&syncdevice_sq(f)->gaps);
+        return -EFAULT;
+    }
+
+    return n;
+}
+
+/*
+   Block for the first token only, then drain whatever is queued up to len
+   so a single read() hands back a whole batch.  mode picks bare tokens,
+   struct sync_record or struct sync_prio_token; the staging buffer fits
+   any of them.
+   */
+//Bytes per token a read() hands out in a binary mode
+static size_t syncdevice_read_size(int mode)
+{
+    switch (mode)
+    {
+        case SYNC_MODE_RECORD:
+            return sizeof(struct sync_record);
+        case SYNC_MODE_PRIORITY:
+            return sizeof(struct sync_prio_token);
+        default:
+            return SYNC_TOKEN_SIZE;
+    }
+}
+
+static ssize_t syncdevice_read_binary(struct file *f, struct iov_iter *to, int mode, bool nonblock)
+{
+    struct sync_queue *sq = syncdevice_sq(f);
+    struct BroadcastReader *reader = READ_ONCE(((struct sync_file *)f->private_data)->reader);
+    struct RBufferQueue *q;
+    struct sync_record stage[SYNC_BATCH];
+    sync_token_t *tokens = (sync_token_t *)stage;
+    struct sync_prio_token *prio = (struct sync_prio_token *)stage;
+    size_t size = syncdevice_read_size(mode), want, done = 0, n = 0;
+    struct RBufferToken token;
+    int ret, lane;
+    u64 now;
+
+    BUILD_BUG_ON(sizeof(struct sync_prio_token) != sizeof(struct sync_record));
+
+    want = iov_iter_count(to) / size;
+    if (want == 0)
+    {
+        return -EINVAL;
+    }
+
+    ret = syncdevice_wait_token(f, &token, &lane, nonblock);
+    if (ret)
+    {
+        return ret;
+    }
+
+    //One clock read per call is plenty for queueing delays, later stamps count as 0
+    now = ktime_get_ns();
+
+    for (;;)
+    {
+        rcu_read_lock();
+        q = rcu_dereference(sq->rq);
+        for (;;)
+        {
+            syncdevice_record_latency(sq, lane, now, token.enqueued);
+
+            switch (mode)
+            {
+                case SYNC_MODE_RECORD:
+                    stage[n].token = token.value;
+                    stage[n].enqueue_ns = token.enqueued;
+                    stage[n].seqno = token.seqno;
+                    break;
+                case SYNC_MODE_PRIORITY:
+                    prio[n].token = token.value;
+                    prio[n].priority = lane;
+                    prio[n].reserved = 0;
+                    prio[n].seqno = token.seqno;
+                    break;
+                default:
+                    tokens[n] = token.value;
+                    break;
+            }
+            n++;
+
+            if (n == SYNC_BATCH || done + n == want || syncdevice_pick(sq, reader, q, &token, &lane))
+            {
+                break;
+            }
+        }
+        rcu_read_unlock();
+
+        syncdevice_wake_writers(sq);
+
+        if (copy_to_iter(stage, n * size, to) != n * size)
+        {
+            //Tokens already taken are lost, same as a failed ASCII read
+            atomic64_add(n, &sq->gaps);
+            return done ? done * size : -EFAULT;
+        }
+        done += n;
+
+        if (n < SYNC_BATCH || done == want || syncdevice_try_remove(sq, reader, &token, &lane))
+        {
+            break;
+        }
+        n = 0;
+    }
+
+    return done * size;
+}
+
+static ssize_t syncdevice_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct sync_file *sf = iocb->ki_filp->private_data;
+
+    pr_debug("(sync device) read()\n");
+
+    if (sf->mode != SYNC_MODE_ASCII)
+    {
+        return syncdevice_read_binary(iocb->ki_filp, to, sf->mode, syncdevice_nowait(iocb));
+    }
+
+    return syncdevice_read_ascii(iocb->ki_filp, to, syncdevice_nowait(iocb));
+}
+
+
+/*
+   Parse whitespace separated decimal tokens.  Anything past the bounce
+   buffer is left for the next write() by returning a short count that
+   stops at the last separator we saw.  A full queue that the policy does
+   not let us wait on cuts the write short right before the token that did
+   not fit.
+   */
+static ssize_t syncdevice_write_ascii(struct file *f, struct iov_iter *from, bool nonblock)
+{
+    struct sync_queue *sq = syncdevice_sq(f);
+    struct RBufferQueue *q;
+    char write_buffer[128];
+    size_t len = iov_iter_count(from);
+    size_t n = min(len, sizeof(write_buffer) - 1);
+    char *p, *word;
+    struct RBufferToken token;
+    int full_policy = READ_ONCE(sq->policy);
+    int lane = ((struct sync_file *)f->private_data)->priority;
+    int queued = 0, ret = 0;
+
+    if (copy_from_iter(write_buffer, n, from) != n)
+    {
+        return -EFAULT;
+    }
+    write_buffer[n] = '\0';
+
+    if (n < len)
+    {
+        while (n > 0 && !isspace(write_buffer[n - 1]))
+        {
+            n--;
+        }
+        if (n == 0)
+        {
+            return -EINVAL;
+        }
+        write_buffer[n] = '\0';
+    }
+
+    token.enqueued = ktime_get_ns();
+    token.seqno = 0;
+
+    rcu_read_lock();
+    q = rcu_dereference(sq->rq);
+
+    p = write_buffer;
+    while ((word = strsep(&p, " \t\n")) != NULL)
+    {
+        if (*word == '\0')
+        {
+            continue;
+        }
+
+        if (kstrtol(word, 10, &token.value) || token.value == 0)
+        {
+            pr_warn_ratelimited("(sync device) Unable to convert it into integer.\n");
+            continue;
+        }
+
+        pr_debug("(sync device) write long value = %ld\n", token.value);
+        while ((ret = syncdevice_push(sq, q, lane, full_policy, &token)))
+        {
+            rcu_read_unlock();
+
+            ret = full_policy == SYNC_POLICY_BLOCK || ret < 0 ? syncdevice_wait_space(sq, lane, nonblock) : -EAGAIN;
+            if (ret)
+            {
+                n = word - write_buffer;
+                goto out;
+            }
+            token.enqueued = ktime_get_ns();
+
+            rcu_read_lock();
+            q = rcu_dereference(sq->rq);
+        }
+        queued++;
+    }
+    rcu_read_unlock();
+
+out:
+    if (queued)
+    {
+        syncdevice_wake_readers(sq);
+    }
+
+    return n ? n : ret;
+}
+
+/*
+   One copy_from_iter per SYNC_BATCH tokens.  Under SYNC_POLICY_EAGAIN (or
+   O_NONBLOCK, or RWF_NOWAIT) a full queue cuts the write short; it only fails if nothing
+   could be queued at all.  tagged writes carry struct sync_prio_token, the
+   others bare tokens for the lane of the file.
+   */
+static ssize_t syncdevice_write_binary(struct file *f, struct iov_iter *from, bool tagged, bool nonblock)
+{
+    struct sync_queue *sq = syncdevice_sq(f);
+    struct RBufferQueue *q;
+    struct sync_prio_token batch[SYNC_BATCH];
+    sync_token_t *tokens = (sync_token_t *)batch;
+    size_t size = tagged ? sizeof(struct sync_prio_token) : SYNC_TOKEN_SIZE;
+    size_t len = iov_iter_count(from), want = len / size, done = 0, n, i;
+    int full_policy = READ_ONCE(sq->policy);
+    int lane = ((struct sync_file *)f->private_data)->priority;
+    ssize_t err = 0;
+    struct RBufferToken token;
+
+    if (want == 0 || len % size)
+    {
+        return -EINVAL;
+    }
+
+    while (done < want)
+    {
+        n = min_t(size_t, want - done, SYNC_BATCH);
+
+        if (copy_from_iter(batch, n * size, from) != n * size)
+        {
+            err = -EFAULT;
+            break;
+        }
+
+        //A bad lane ends the write right before the offending token
+        for (i = 0; tagged && i < n; i++)
+        {
+            if (batch[i].priority >= SYNC_PRIORITIES || batch[i].reserved)
+            {
+                err = -EINVAL;
+                n = i;
+                break;
+            }
+        }
+
+        token.enqueued = ktime_get_ns();
+        token.seqno = 0;
+
+        for (i = 0; i < n; )
+        {
+            rcu_read_lock();
+            q = rcu_dereference(sq->rq);
+            for (; i < n; i++)
+            {
+                if (tagged)
+                {
+                    lane = batch[i].priority;
+                    token.value = batch[i].token;
+                }
+                else
+                {
+                    token.value = tokens[i];
+                }
+
+                err = syncdevice_push(sq, q, lane, full_policy, &token);
+                if (err)
+                {
+                    break;
+                }
+            }
+            rcu_read_unlock();
+
+            if (i == n)
+            {
+                break;
+            }
+
+            err = full_policy == SYNC_POLICY_BLOCK || err < 0 ? syncdevice_wait_space(sq, lane, nonblock) : -EAGAIN;
+            if (err)
+            {
+                break;
+            }
+            token.enqueued = ktime_get_ns();
+        }
+        done += i;
+
+        if (err)
+        {
+            break;
+        }
+    }
+
+    if (done == 0)
+    {
+        return err;
+    }
+
+    syncdevice_wake_readers(sq);
+
+    return done * size;
+}
+
+static ssize_t syncdevice_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct sync_file *sf = iocb->ki_filp->private_data;
+
+    pr_debug("(sync device) write()\n");
+
+    //Records are a read-side format, writers in that mode send bare tokens
+    if (sf->mode != SYNC_MODE_ASCII)
+    {
+        return syncdevice_write_binary(iocb->ki_filp, from, sf->mode == SYNC_MODE_PRIORITY,
+                                       syncdevice_nowait(iocb));
+    }
+
+    return syncdevice_write_ascii(iocb->ki_filp, from, syncdevice_nowait(iocb));
+}
+
+/*
+   IORING_OP_URING_CMD: a whole batch of tokens per submission, in the
+   binary encoding of the file (ASCII files move bare tokens).  It runs
+   synchronously; the first attempt comes from the submitting task with
+   IO_URING_F_NONBLOCK, and an -EAGAIN there makes io_uring retry from one
+   of its workers, which may sleep.  SYNC_URING_NOWAIT asks for a
+   completion with 0 tokens instead, for callers that wait in poll().
+   */
+static int syncdevice_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    const struct sync_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+    struct file *f = ioucmd->file;
+    struct sync_file *sf = f->private_data;
+    int mode = sf->mode == SYNC_MODE_ASCII ? SYNC_MODE_BINARY : sf->mode;
+    u64 addr = READ_ONCE(cmd->addr);
+    u32 count = READ_ONCE(cmd->count), flags = READ_ONCE(cmd->flags);
+    bool nonblock = (flags & SYNC_URING_NOWAIT) || (f->f_flags & O_NONBLOCK) ||
+        (issue_flags & IO_URING_F_NONBLOCK);
+    struct iov_iter iter;
+    size_t size;
+    ssize_t ret;
+
+    if (flags & ~SYNC_URING_NOWAIT)
+    {
+        return -EINVAL;
+    }
+
+    switch (ioucmd->cmd_op)
+    {
+        case SYNC_URING_ENQUEUE:
+            size = mode == SYNC_MODE_PRIORITY ? sizeof(struct sync_prio_token) : SYNC_TOKEN_SIZE;
+            ret = import_ubuf(ITER_SOURCE, u64_to_user_ptr(addr), (size_t)count * size, &iter);
+            if (ret)
+            {
+                return ret;
+            }
+            ret = syncdevice_write_binary(f, &iter, mode == SYNC_MODE_PRIORITY, nonblock);
+            break;
+
+        case SYNC_URING_DEQUEUE:
+            size = syncdevice_read_size(mode);
+            ret = import_ubuf(ITER_DEST, u64_to_user_ptr(addr), (size_t)count * size, &iter);
+            if (ret)
+            {
+                return ret;
+            }
+            ret = syncdevice_read_binary(f, &iter, mode, nonblock);
+            break;
+
+        default:
+            return -ENOTTY;
+    }
+
+    if (ret == -EAGAIN && (flags & SYNC_URING_NOWAIT))
+    {
+        return 0;
+    }
+
+    return ret < 0 ? ret : ret / size;
+}
+
+
+static long syncdevice_ring_info(struct sync_queue *sq, void __user *argp)
+{
+    struct RBufferQueue *q;
+    struct RBufferRing *ring;
+    struct sync_ring_info info;
+
+    //The mapped layout is struct RBufferCtrl/struct RBuffer as-is
+    BUILD_BUG_ON(sizeof(struct RBuffer) != sizeof(struct sync_slot));
+    BUILD_BUG_ON(offsetof(struct RBuffer, sequence) != offsetof(struct sync_slot, sequence));
+    BUILD_BUG_ON(offsetof(struct RBuffer, timestamp) != offsetof(struct sync_slot, token));
+    BUILD_BUG_ON(offsetof(struct RBuffer, enqueued) != offsetof(struct sync_slot, enqueue_ns));
+    BUILD_BUG_ON(offsetof(struct RBuffer, seqno) != offsetof(struct sync_slot, seqno));
+    BUILD_BUG_ON(RBUFFER_NEED_WAKEUP != SYNC_RING_NEED_WAKEUP);
+    BUILD_BUG_ON(RBUFFER_NEED_SPACE != SYNC_RING_NEED_SPACE);
+
+    memset(&info, 0, sizeof(info));
+
+    rcu_read_lock();
+    q = rcu_dereference(sq->rq);
+    ring = &q->shared;
+    if (!ring->mappable || q->local || syncdevice_bcast(sq))
+    {
+        rcu_read_unlock();
+        return -EOPNOTSUPP;
+    }
+
+    info.capacity = ring->capacity;
+    info.slot_size = sizeof(struct RBuffer);
+    info.head_off = offsetof(struct RBufferCtrl, head);
+    info.tail_off = offsetof(struct RBufferCtrl, tail);
+    info.flags_off = offsetof(struct RBufferCtrl, flags);
+    info.slots_off = (void *)ring->slots - ring->mem;
+    info.map_size = ring->mem_size;
+    rcu_read_unlock();
+
+    if (copy_to_user(argp, &info, sizeof(info)))
+    {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/*
+   A user space producer published tokens while someone was going to sleep,
+   or a user space consumer made room for a blocked writer.  Both kinds of
+   sleepers re-arm their flag if they still have to wait.
+   */
+static long syncdevice_doorbell(struct sync_queue *sq)
+{
+    rcu_read_lock();
+    RBuffer_ClearWakeup(rcu_dereference(sq->rq));
+    rcu_read_unlock();
+
+    wake_up_interruptible_all(&sq->read_wait);
+    wake_up_interruptible_all(&sq->write_wait);
+
+    return 0;
+}
+
+static u32 syncdevice_capacity(struct sync_queue *sq)
+{
+    u32 ret;
+
+    rcu_read_lock();
+    ret = rcu_dereference(sq->rq)->shared.capacity;
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/*
+   Swap in rings of a new capacity.  Only the sole opener of an unmapped
+   queue may do this, and whatever is queued in each lane has to fit.  The
+   file may still be shared through dup() or fork(), so readers and writers
+   are held off while the tokens move: the new rings only go live once
+   they hold everything queued before, and nothing can get ahead of it.
+   */
+static long syncdevice_set_capacity(struct sync_queue *sq, u32 __user *argp)
+{
+    struct RBufferQueue *q, *old;
+    u32 new_capacity;
+    struct RBufferToken token;
+    int lane;
+    bool busy;
+
+    if (get_user(new_capacity, argp))
+    {
+        return -EFAULT;
+    }
+
+    q = syncdevice_lanes_create(new_capacity, &sq->seqno);
+    if (IS_ERR(q))
+    {
+        return PTR_ERR(q);
+    }
+
+    mutex_lock(&sq->lock);
+    old = rcu_dereference_protected(sq->rq, lockdep_is_held(&sq->lock));
+
+    if (atomic_read(&sq->opens) > 1 || atomic_read(&sq->maps) || sq->bcast)
+    {
+        mutex_unlock(&sq->lock);
+        syncdevice_lanes_destroy(q);
+        return -EBUSY;
+    }
+
+    //Whoever got in before the flag is out of the rings after this
+    WRITE_ONCE(sq->resizing, true);
+    synchronize_rcu();
+
+    busy = false;
+    for (lane = 0; lane < SYNC_PRIORITIES && !busy; lane++)
+    {
+        busy = RBuffer_Size(&old[lane]) > q->shared.capacity;
+    }
+
+    if (!busy)
+    {
+        for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+        {
+            while (RBuffer_TryRemove(&old[lane], &token) == 0)
+            {
+                if (RBuffer_InsertToken(&q[lane], &token))
+                {
+                    atomic64_inc(&sq->gaps);
+                }
+            }
+        }
+        rcu_assign_pointer(sq->rq, q);
+
+        //Anyone who fetched the old rings is done with them before the flag drops
+        synchronize_rcu();
+    }
+
+    WRITE_ONCE(sq->resizing, false);
+    mutex_unlock(&sq->lock);
+
+    //Sleepers were looking at the old rings, or at the flag
+    wake_up_interruptible_all(&sq->read_wait);
+    wake_up_interruptible_all(&sq->write_wait);
+
+    if (busy)
+    {
+        syncdevice_lanes_destroy(q);
+        return -EBUSY;
+    }
+    syncdevice_lanes_destroy(old);
+
+    printk("(sync device) capacity = %u\n", q->shared.capacity);
+
+    return 0;
+}
+
+/*
+   Detach this file from its minor and give it a queue of its own with the
+   same capacity.  Only this file (and its dups, forks and mappings) can see
+   the new queue; it is freed on the final close.
+   */
+static long syncdevice_set_private(struct file *f)
+{
+    struct sync_file *sf = f->private_data;
+    struct sync_queue *shared = syncdevice_sq(f), *sq;
+    int ret;
+
+    //A broadcast reader stays with the stream it subscribed to
+    if (shared->is_private || READ_ONCE(sf->reader))
+    {
+        return -EBUSY;
+    }
+
+    sq = kzalloc(sizeof(*sq), GFP_KERNEL);
+    if (!sq)
+    {
+        return -ENOMEM;
+    }
+
+    ret = syncdevice_queue_init(sq, syncdevice_capacity(shared), READ_ONCE(shared->policy));
+    if (ret)
+    {
+        kfree(sq);
+        return ret;
+    }
+    sq->is_private = true;
+
+    //Two threads racing on the same file: only one of them gets to switch
+    if (cmpxchg(&sf->sq, shared, sq) != shared)
+    {
+        syncdevice_queue_free(sq);
+        return -EBUSY;
+    }
+
+    syncdevice_queue_put(shared);
+
+    return 0;
+}
+
+static long syncdevice_set_policy(struct sync_queue *sq, int __user *argp)
+{
+    int full_policy;
+
+    if (get_user(full_policy, argp))
+    {
+        return -EFAULT;
+    }
+
+    if (full_policy < SYNC_POLICY_BLOCK || full_policy > SYNC_POLICY_DROP)
+    {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(sq->policy, full_policy);
+
+    //Blocked writers of the old policy must not sleep on under the new one
+    wake_up_interruptible_all(&sq->write_wait);
+
+    return 0;
+}
+
+static long syncdevice_stats(struct sync_queue *sq, void __user *argp)
+{
+    struct sync_stats stats;
+    struct RBufferQueue *q;
+    int lane;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.dropped = atomic64_read(&sq->dropped);
+    stats.overwritten = atomic64_read(&sq->overwritten);
+    stats.seqno = atomic64_read(&sq->seqno);
+    stats.gaps = atomic64_read(&sq->gaps);
+    stats.blocked = atomic64_read(&sq->blocked);
+
+    rcu_read_lock();
+    q = rcu_dereference(sq->rq);
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        stats.depth[lane] = RBuffer_Size(&q[lane]);
+    }
+    rcu_read_unlock();
+
+    if (copy_to_user(argp, &stats, sizeof(stats)))
+    {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static long syncdevice_set_sched(struct sync_queue *sq, void __user *argp)
+{
+    struct sync_sched sched;
+    u32 total = 0;
+    int lane;
+
+    if (copy_from_user(&sched, argp, sizeof(sched)))
+    {
+        return -EFAULT;
+    }
+
+    if (sched.policy != SYNC_SCHED_STRICT && sched.policy != SYNC_SCHED_WEIGHTED)
+    {
+        return -EINVAL;
+    }
+
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        if (sched.weight[lane] > SYNC_WEIGHT_MAX)
+        {
+            return -EINVAL;
+        }
+        total += sched.weight[lane];
+    }
+
+    if (sched.policy == SYNC_SCHED_WEIGHTED && total == 0)
+    {
+        return -EINVAL;
+    }
+
+    //Readers load this without the lock, a torn update only skews a few turns
+    mutex_lock(&sq->lock);
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        WRITE_ONCE(sq->sched.weight[lane], sched.weight[lane]);
+    }
+    WRITE_ONCE(sq->sched.policy, sched.policy);
+    mutex_unlock(&sq->lock);
+
+    return 0;
+}
+
+static long syncdevice_get_sched(struct sync_queue *sq, void __user *argp)
+{
+    struct sync_sched sched;
+
+    mutex_lock(&sq->lock);
+    sched = sq->sched;
+    mutex_unlock(&sq->lock);
+
+    if (copy_to_user(argp, &sched, sizeof(sched)))
+    {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/*
+   Turn the queue into a broadcast queue and subscribe the caller.  Like a
+   resize this needs the only opener of an unmapped queue, and it has to be
+   empty: nothing queued could be handed to every reader.  Files opened
+   later subscribe in open().
+   */
+static long syncdevice_set_broadcast(struct file *f)
+{
+    struct sync_file *sf = f->private_data;
+    struct sync_queue *sq = syncdevice_sq(f);
+    struct RBufferQueue *q;
+    struct Broadcast *bcast;
+    struct BroadcastReader *reader;
+    int lane, ret;
+
+    bcast = kzalloc(sizeof(*bcast), GFP_KERNEL);
+    reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+    if (!bcast || !reader)
+    {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    ret = Broadcast_Create(bcast, syncdevice_capacity(sq));
+    if (ret)
+    {
+        goto fail;
+    }
+
+    mutex_lock(&sq->lock);
+    q = rcu_dereference_protected(sq->rq, lockdep_is_held(&sq->lock));
+
+    ret = sq->bcast || atomic_read(&sq->opens) > 1 || atomic_read(&sq->maps) ? -EBUSY : 0;
+    for (lane = 0; lane < SYNC_PRIORITIES && !ret; lane++)
+    {
+        ret = RBuffer_IsEmpty(&q[lane]) ? 0 : -EBUSY;
+    }
+
+    if (ret)
+    {
+        mutex_unlock(&sq->lock);
+        Broadcast_Destroy(bcast);
+        goto fail;
+    }
+
+    Broadcast_Join(bcast, reader);
+    WRITE_ONCE(sf->reader, reader);
+    smp_store_release(&sq->bcast, bcast);
+    mutex_unlock(&sq->lock);
+
+    //Anybody asleep on the lanes has to come back and look at the new ring
+    wake_up_interruptible_all(&sq->read_wait);
+    wake_up_interruptible_all(&sq->write_wait);
+
+    return 0;
+
+fail:
+    kfree(reader);
+    kfree(bcast);
+    return ret;
+}
+
+static long syncdevice_lag(struct file *f, void __user *argp)
+{
+    struct sync_file *sf = f->private_data;
+    struct BroadcastReader *reader = READ_ONCE(sf->reader);
+    struct sync_lag lag;
+
+    if (!reader)
+    {
+        return -EINVAL;
+    }
+
+    memset(&lag, 0, sizeof(lag));
+    lag.lag = Broadcast_Lag(sf->sq->bcast, reader);
+    lag.skipped = READ_ONCE(reader->skipped);
+    lag.stalls = READ_ONCE(reader->stalls);
+
+    if (copy_to_user(argp, &lag, sizeof(lag)))
+    {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static long syncdevice_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+    struct sync_file *sf = f->private_data;
+    int __user *argp = (int __user *)arg;
+    int mode, priority;
+
+    switch (cmd)
+    {
+        case SYNC_IOC_SET_MODE:
+            if (get_user(mode, argp))
+            {
+                return -EFAULT;
+            }
+            if (mode < SYNC_MODE_ASCII || mode > SYNC_MODE_PRIORITY)
+            {
+                return -EINVAL;
+            }
+            sf->mode = mode;
+            return 0;
+
+        case SYNC_IOC_GET_MODE:
+            return put_user(sf->mode, argp);
+
+        case SYNC_IOC_RING_INFO:
+            return syncdevice_ring_info(syncdevice_sq(f), (void __user *)arg);
+
+        case SYNC_IOC_DOORBELL:
+            return syncdevice_doorbell(syncdevice_sq(f));
+
+        case SYNC_IOC_SET_CAPACITY:
+            return syncdevice_set_capacity(syncdevice_sq(f), (u32 __user *)arg);
+
+        case SYNC_IOC_GET_CAPACITY:
+            return put_user(syncdevice_capacity(syncdevice_sq(f)), (u32 __user *)arg);
+
+        case SYNC_IOC_SET_PRIVATE:
+            return syncdevice_set_private(f);
+
+        case SYNC_IOC_SET_POLICY:
+            return syncdevice_set_policy(syncdevice_sq(f), argp);
+
+        case SYNC_IOC_GET_POLICY:
+            return put_user(READ_ONCE(syncdevice_sq(f)->policy), argp);
+
+        case SYNC_IOC_GET_STATS:
+            return syncdevice_stats(syncdevice_sq(f), (void __user *)arg);
+
+        case SYNC_IOC_SET_PRIORITY:
+            if (get_user(priority, argp))
+            {
+                return -EFAULT;
+            }
+            if (priority < 0 || priority >= SYNC_PRIORITIES)
+            {
+                return -EINVAL;
+            }
+            WRITE_ONCE(sf->priority, priority);
+            return 0;
+
+        case SYNC_IOC_GET_PRIORITY:
+            return put_user(READ_ONCE(sf->priority), argp);
+
+        case SYNC_IOC_SET_SCHED:
+            return syncdevice_set_sched(syncdevice_sq(f), (void __user *)arg);
+
+        case SYNC_IOC_GET_SCHED:
+            return syncdevice_get_sched(syncdevice_sq(f), (void __user *)arg);
+
+        case SYNC_IOC_SET_BROADCAST:
+            return syncdevice_set_broadcast(f);
+
+        case SYNC_IOC_GET_LAG:
+            return syncdevice_lag(f, (void __user *)arg);
+
+        default:
+            return -ENOTTY;
+    }
+}
+
+
+static __poll_t syncdevice_poll(struct file *f, poll_table *wait)
+{
+    struct sync_queue *sq = syncdevice_sq(f);
+    __poll_t mask = 0;
+
+    poll_wait(f, &sq->read_wait, wait);
+    poll_wait(f, &sq->write_wait, wait);
+
+    if (syncdevice_readable(sq, READ_ONCE(((struct sync_file *)f->private_data)->reader)))
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    //Overwrite and drop take every write, the others have to wait for room
+    switch (READ_ONCE(sq->policy))
+    {
+        case SYNC_POLICY_OVERWRITE:
+        case SYNC_POLICY_DROP:
+            mask |= EPOLLOUT | EPOLLWRNORM;
+            break;
+
+        default:
+            if (syncdevice_writable(sq, READ_ONCE(((struct sync_file *)f->private_data)->priority)))
+            {
+                mask |= EPOLLOUT | EPOLLWRNORM;
+            }
+            break;
+    }
+
+    return mask;
+}
+
+
+
+
+/*
+   Count mappings so SYNC_IOC_SET_CAPACITY cannot free rings that are
+   still mapped somewhere.  open also runs for fork and VMA splits.
+   */
+static void syncdevice_vm_open(struct vm_area_struct *vma)
+{
+    struct sync_queue *sq = vma->vm_private_data;
+
+    atomic_inc(&sq->maps);
+}
+
+static void syncdevice_vm_close(struct vm_area_struct *vma)
+{
+    struct sync_queue *sq = vma->vm_private_data;
+
+    atomic_dec(&sq->maps);
+}
+
+static const struct vm_operations_struct syncdevice_vm_ops =
+{
+    .open = syncdevice_vm_open,
+    .close = syncdevice_vm_close,
+};
+
+/*
+   Map the shared ring (cursors page plus slots) into user space.  The
+   per-CPU rings cannot be shared, so mmap is refused when they are on.
+   */
+static int syncdevice_mmap(struct file *f, struct vm_area_struct *vma)
+{
+    struct sync_queue *sq = syncdevice_sq(f);
+    struct RBufferQueue *q;
+    struct RBufferRing *ring;
+    int ret;
+
+    mutex_lock(&sq->lock);
+    q = rcu_dereference_protected(sq->rq, lockdep_is_held(&sq->lock));
+    ring = &q->shared;
+
+    if (!ring->mappable || q->local || sq->bcast)
+    {
+        ret = -EOPNOTSUPP;
+    }
+    else if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > ring->mem_size)
+    {
+        ret = -EINVAL;
+    }
+    else
+    {
+        ret = remap_vmalloc_range(vma, ring->mem, 0);
+    }
+
+    if (ret == 0)
+    {
+        vma->vm_ops = &syncdevice_vm_ops;
+        vma->vm_private_data = sq;
+        syncdevice_vm_open(vma);
+    }
+    mutex_unlock(&sq->lock);
+
+    return ret;
+}
+
+
+static struct file_operations syncdevice_fops =
+{
+    .owner = THIS_MODULE,
+    .open = syncdevice_open,
+    .release = syncdevice_close,
+    .write_iter = syncdevice_write_iter,
+    .read_iter = syncdevice_read_iter,
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
+    .uring_cmd = syncdevice_uring_cmd,
+    .poll = syncdevice_poll,
+    .mmap = syncdevice_mmap,
+    .unlocked_ioctl = syncdevice_ioctl,
+    .compat_ioctl = syncdevice_ioctl,
+};
+
+
+/*
+   debugfs: syncdevice/<node>/latency shows the enqueue to dequeue delay
+   of every token a reader got out of the minor, one histogram per lane.
+   Writing to it clears them.
+   */
+static int syncdevice_latency_show(struct seq_file *m, void *v)
+{
+    struct sync_queue *sq = m->private;
+
+    int lane, ret;
+
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        seq_printf(m, "lane %d\n", lane);
+        ret = LatencyHist_Show(&sq->latency[lane], m);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int syncdevice_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, syncdevice_latency_show, inode->i_private);
+}
+
+static ssize_t syncdevice_latency_write(struct file *file, const char __user *buf, size_t len, loff_t *off)
+{
+    struct sync_queue *sq = ((struct seq_file *)file->private_data)->private;
+
+    int lane;
+
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        LatencyHist_Reset(&sq->latency[lane]);
+    }
+
+    return len;
+}
+
+static const struct file_operations syncdevice_latency_fops =
+{
+    .owner = THIS_MODULE,
+    .open = syncdevice_latency_open,
+    .read = seq_read,
+    .write = syncdevice_latency_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+//syncdevice/<node>/stats, the counters of struct sync_stats
+static int syncdevice_stats_show(struct seq_file *m, void *v)
+{
+    struct sync_queue *sq = m->private;
+    struct RBufferQueue *q;
+    struct Broadcast *bcast;
+    struct BroadcastReader *reader;
+    int lane;
+
+    seq_printf(m, "policy %d\n", READ_ONCE(sq->policy));
+    seq_printf(m, "dropped %lld\n", (long long)atomic64_read(&sq->dropped));
+    seq_printf(m, "overwritten %lld\n", (long long)atomic64_read(&sq->overwritten));
+    seq_printf(m, "blocked %lld\n", (long long)atomic64_read(&sq->blocked));
+    seq_printf(m, "seqno %lld\n", (long long)atomic64_read(&sq->seqno));
+    seq_printf(m, "gaps %lld\n", (long long)atomic64_read(&sq->gaps));
+
+    rcu_read_lock();
+    q = rcu_dereference(sq->rq);
+    for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+    {
+        seq_printf(m, "lane %d depth %d\n", lane, RBuffer_Size(&q[lane]));
+    }
+    rcu_read_unlock();
+
+    //One line per subscriber, the slowest one is what holds writers back
+    bcast = syncdevice_bcast(sq);
+    if (bcast)
+    {
+        spin_lock(&bcast->lock);
+        list_for_each_entry(reader, &bcast->readers, node)
+        {
+            seq_printf(m, "reader lag %llu skipped %llu stalls %llu\n",
+                       Broadcast_Lag(bcast, reader), reader->skipped, reader->stalls);
+        }
+        spin_unlock(&bcast->lock);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(syncdevice_stats);
+
+static void syncdevice_debugfs_init(void)
+{
+    struct dentry *dir;
+    char name[32];
+    unsigned int m;
+
+    sync_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+
+    for (m = 0; m < minors; m++)
+    {
+        snprintf(name, sizeof(name), m ? "syncdevice%u" : "syncdevice", m);
+        dir = debugfs_create_dir(name, sync_debugfs);
+        debugfs_create_file("latency", 0600, dir, &syncqs[m], &syncdevice_latency_fops);
+        debugfs_create_file("stats", 0400, dir, &syncqs[m], &syncdevice_stats_fops);
+    }
+}
+
+static void syncdevice_queues_exit(unsigned int count)
+{
+    unsigned int m;
+    int lane;
+
+    for (m = 0; m < count; m++)
+    {
+        for (lane = 0; lane < SYNC_PRIORITIES; lane++)
+        {
+            RBuffer_ShowContents(&rcu_dereference_protected(syncqs[m].rq, 1)[lane]);
+        }
+        syncdevice_queue_exit(&syncqs[m]);
+    }
+
+    kfree(syncqs);
+    syncqs = NULL;
+}
+
+static void syncdevice_nodes_destroy(unsigned int count)
+{
+    unsigned int m;
+
+    for (m = 0; m < count; m++)
+    {
+        device_destroy(cl, first + m);
+    }
+}
+
+
+static int __init syncdevice_init(void)
+{
+    unsigned int m;
+    int ret;
+
+    printk("(sync device) Module init()\n");
+
+    if (minors < 1 || minors > SYNC_MAX_MINORS)
+    {
+        printk("(sync device) minors must be between 1 and %d.\n", SYNC_MAX_MINORS);
+        return -EINVAL;
+    }
+
+    if (policy > SYNC_POLICY_DROP)
+    {
+        printk("(sync device) Unknown policy %u.\n", policy);
+        return -EINVAL;
+    }
+
+    syncqs = kcalloc(minors, sizeof(*syncqs), GFP_KERNEL);
+    if (!syncqs)
+    {
+        return -ENOMEM;
+    }
+
+    for (m = 0; m < minors; m++)
+    {
+        ret = syncdevice_queue_init(&syncqs[m], capacity, policy);
+        if (ret)
+        {
+            printk("(sync device) Unable to create a queue of %u tokens.\n", capacity);
+            syncdevice_queues_exit(m);
+            return ret;
+        }
+    }
+
+    //Register a range of char device numbers baseminor = 0, count = minors name syncdevice
+    if (alloc_chrdev_region(&first, 0, minors, "syncdevice") < 0)
+    {
+        syncdevice_queues_exit(minors);
+        return -1;
+    }
+
+    //Create a struct class structure
+    cl = class_create("chardrv");
+    if (IS_ERR(cl))
+    {
+        unregister_chrdev_region(first, minors);
+        syncdevice_queues_exit(minors);
+        return PTR_ERR(cl);
+    }
+
+    //Minor 0 keeps the historic /dev/syncdevice name
+    for (m = 0; m < minors; m++)
+    {
+        if (IS_ERR(device_create(cl, NULL, first + m, NULL, m ? "syncdevice%u" : "syncdevice", m)))
+        {
+            syncdevice_nodes_destroy(m);
+            class_destroy(cl);
+            unregister_chrdev_region(first, minors);
+            syncdevice_queues_exit(minors);
+            return -1;
+        }
+    }
+
+    cdev_init(&c_dev, &syncdevice_fops);
+
+    if (cdev_add(&c_dev, first, minors) < 0)
+    {
+        syncdevice_nodes_destroy(minors);
+        class_destroy(cl);
+        unregister_chrdev_region(first, minors);
+        syncdevice_queues_exit(minors);
+        return -1;
+    }
+
+    //debugfs is best effort, a failure only costs the statistics
+    syncdevice_debugfs_init();
+
+    return 0;
+}
+
+static void __exit syncdevice_exit(void)
+{
+    printk("(sync device)Module exit.\n");
+
+    debugfs_remove_recursive(sync_debugfs);
+
+    cdev_del(&c_dev);
+    syncdevice_nodes_destroy(minors);
+    class_destroy(cl);
+    unregister_chrdev_region(first, minors);
+
+    syncdevice_queues_exit(minors);
+}
+
+module_init(syncdevice_init);
+module_exit(syncdevice_exit);
+
+MODULE_LICENSE("GPL");
@@ -0,0 +1,262 @@
+/*
+   ================================================================
+Name        : syncdevice.h
+Description : Interface shared by syncdevice.ko and its clients
+================================================================
+*/
+
+#ifndef SYNCDEVICE_H
+#define SYNCDEVICE_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+   Token encodings of read()/write(), selected per open file.
+
+   SYNC_MODE_ASCII  one decimal token per read(), whitespace separated
+                    decimal tokens per write() -- what echo and cat expect.
+                    A read() needs room for SYNC_ASCII_TOKEN_MAX bytes,
+                    anything shorter fails with EINVAL.
+   SYNC_MODE_BINARY arrays of native endian 64-bit tokens.  Lengths must be
+                    a multiple of SYNC_TOKEN_SIZE; a read() returns as many
+                    tokens as are queued (up to len) in one copy.
+   SYNC_MODE_RECORD like binary, but read() returns struct sync_record so
+                    the consumer also learns when each token was queued.
+   SYNC_MODE_PRIORITY read() and write() move struct sync_prio_token, so
+                    every token picks its own lane.
+
+   readv()/writev(), preadv2()/pwritev2() and splice() use the same
+   encodings.  RWF_NOWAIT makes one call behave as if the file were
+   O_NONBLOCK: EAGAIN instead of sleeping on an empty or full queue.
+
+   Every token written through the fd gets a sequence number from a
+   per-queue counter as it goes in: 1, 2, 3 ... in the order the inserts
+   happened, across all lanes.  A token that is thrown away still uses up
+   its number, so a number that never shows up on the read side is a token
+   the device lost, and struct sync_stats counts those as gaps.  Concurrent
+   writers and several lanes mean readers need not see numbers in
+   increasing order; a broadcast queue numbers under its lock, so there
+   every reader does.  Tokens produced through the mapped ring carry
+   whatever seqno the producer stored, 0 if it does not care.
+   */
+#define SYNC_MODE_ASCII                 0
+#define SYNC_MODE_BINARY                1
+#define SYNC_MODE_RECORD                2
+#define SYNC_MODE_PRIORITY              3
+
+typedef __s64 sync_token_t;
+
+#define SYNC_TOKEN_SIZE                 sizeof(sync_token_t)
+#define SYNC_ASCII_TOKEN_MAX            20      //strlen("-9223372036854775808")
+
+//enqueue_ns is CLOCK_MONOTONIC in nanoseconds, taken when the token was queued
+struct sync_record
+{
+    __s64 token;
+    __u64 enqueue_ns;
+    __u64 seqno;
+};
+
+/*
+   Every queue has SYNC_PRIORITIES lanes, each a ring of its own.  Higher
+   lanes are more urgent: readers serve them first (SYNC_SCHED_STRICT) or
+   in proportion to their weight (SYNC_SCHED_WEIGHTED).  Tokens go to the
+   lane of the file (SYNC_IOC_SET_PRIORITY, 0 by default) unless they say
+   otherwise in SYNC_MODE_PRIORITY.
+   */
+#define SYNC_PRIORITIES                 4
+
+struct sync_prio_token
+{
+    __s64 token;
+    __u32 priority;     //Lane, 0 .. SYNC_PRIORITIES - 1
+    __u32 reserved;     //Must be 0
+    __u64 seqno;        //Filled in by read(), ignored by write()
+};
+
+/*
+   Shared ring, mmap(fd, info.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, 0)
+   after SYNC_IOC_RING_INFO.  It is the same ring read()/write() use, so the
+   two paths can be mixed freely.
+
+   The mapped ring is lane 0, tokens produced through it are not urgent.
+   The kernel does not trust their enqueue_ns: it is handed to readers as
+   stored, but a stamp from the future counts as no delay in the latency
+   histogram.
+
+   head, tail and flags are __u64/__u64/__u32 at the given offsets, slots
+   is an array of capacity entries of slot_size bytes starting with
+   struct sync_slot.  capacity is a power of two and position p lives in
+   slot p & (capacity - 1).
+
+   Produce: claim p = tail once slots[p].sequence == p by cmpxchg(tail, p,
+            p + 1), store the token, its CLOCK_MONOTONIC enqueue_ns and a
+            seqno of your own (or 0), then store-release sequence = p + 1.
+   Consume: claim p = head once slots[p].sequence == p + 1 by cmpxchg(head,
+            p, p + 1), load the token, then store-release sequence =
+            p + capacity.
+
+   Sleeping: a consumer waits with poll(POLLIN) on the fd.  The kernel sets
+   SYNC_RING_NEED_WAKEUP in flags before it lets anyone sleep, so after a
+   publish a producer issues a full barrier, loads flags and only calls
+   SYNC_IOC_DOORBELL when the bit is set.  In steady state neither side
+   makes a system call.
+   */
+struct sync_slot
+{
+    __u64 sequence;
+    __s64 token;
+    __u64 enqueue_ns;
+    __u64 seqno;
+};
+
+struct sync_ring_info
+{
+    __u32 capacity;
+    __u32 slot_size;
+    __u32 head_off;
+    __u32 tail_off;
+    __u32 flags_off;
+    __u32 slots_off;
+    __u64 map_size;
+};
+
+#define SYNC_RING_NEED_WAKEUP           (1U << 0)
+#define SYNC_RING_NEED_SPACE            (1U << 1)
+
+#define SYNC_IOC_MAGIC                  'S'
+
+#define SYNC_IOC_SET_MODE               _IOW(SYNC_IOC_MAGIC, 1, int)
+#define SYNC_IOC_GET_MODE               _IOR(SYNC_IOC_MAGIC, 2, int)
+#define SYNC_IOC_RING_INFO              _IOR(SYNC_IOC_MAGIC, 3, struct sync_ring_info)
+#define SYNC_IOC_DOORBELL               _IO(SYNC_IOC_MAGIC, 4)
+
+/*
+   Capacity in tokens, rounded up to a power of two.  Setting it replaces
+   the rings and fails with EBUSY unless the caller is the only opener, the
+   ring is not mapped and the queued tokens fit.
+   */
+#define SYNC_IOC_SET_CAPACITY           _IOW(SYNC_IOC_MAGIC, 5, __u32)
+#define SYNC_IOC_GET_CAPACITY           _IOR(SYNC_IOC_MAGIC, 6, __u32)
+
+/*
+   Give this open file a queue of its own instead of the minor's shared
+   one.  Only the file itself (dups, forks, mappings) sees the new queue,
+   which is freed on its last close.  Done at most once per open.
+   */
+#define SYNC_IOC_SET_PRIVATE            _IO(SYNC_IOC_MAGIC, 7)
+
+/*
+   What write() does with a token that finds the queue full.  The policy
+   belongs to the queue, so it applies to every writer of the minor (or of
+   the private queue).
+
+   SYNC_POLICY_BLOCK     sleep until a reader makes room (lossless), or
+                         EAGAIN on an O_NONBLOCK file.
+   SYNC_POLICY_EAGAIN    stop there: the write is cut short, or fails with
+                         EAGAIN if nothing could be queued.
+   SYNC_POLICY_OVERWRITE throw the oldest queued token away to make room.
+   SYNC_POLICY_DROP      throw the new token away.
+
+   Writes only ever come back short under the first two, the others always
+   take everything and account for the loss in struct sync_stats.
+   */
+#define SYNC_POLICY_BLOCK               0
+#define SYNC_POLICY_EAGAIN              1
+#define SYNC_POLICY_OVERWRITE           2
+#define SYNC_POLICY_DROP                3
+
+struct sync_stats
+{
+    __u64 dropped;      //New tokens thrown away, SYNC_POLICY_DROP
+    __u64 overwritten;  //Queued tokens thrown away, SYNC_POLICY_OVERWRITE
+    __u64 blocked;      //Times a writer had to sleep, SYNC_POLICY_BLOCK
+    __u64 depth[SYNC_PRIORITIES];   //Tokens queued per lane right now
+    __u64 seqno;        //Last sequence number handed out
+    __u64 gaps;         //Sequence numbers no reader will ever get
+};
+
+#define SYNC_IOC_SET_POLICY             _IOW(SYNC_IOC_MAGIC, 8, int)
+#define SYNC_IOC_GET_POLICY             _IOR(SYNC_IOC_MAGIC, 9, int)
+#define SYNC_IOC_GET_STATS              _IOR(SYNC_IOC_MAGIC, 10, struct sync_stats)
+
+//Lane of this open file's writes outside SYNC_MODE_PRIORITY
+#define SYNC_IOC_SET_PRIORITY           _IOW(SYNC_IOC_MAGIC, 11, int)
+#define SYNC_IOC_GET_PRIORITY           _IOR(SYNC_IOC_MAGIC, 12, int)
+
+/*
+   How readers of a queue pick the next lane.
+
+   SYNC_SCHED_STRICT   the most urgent non-empty lane, always (default).
+                       Bulk lanes starve while urgent ones have tokens.
+   SYNC_SCHED_WEIGHTED lane i gets weight[i] out of every sum(weight)
+                       dequeues; a turn that finds its lane empty falls
+                       back to strict.  A weight of 0 only gets leftovers.
+   */
+#define SYNC_SCHED_STRICT               0
+#define SYNC_SCHED_WEIGHTED             1
+
+#define SYNC_WEIGHT_MAX                 1024
+
+struct sync_sched
+{
+    __u32 policy;
+    __u32 weight[SYNC_PRIORITIES];
+};
+
+#define SYNC_IOC_SET_SCHED              _IOW(SYNC_IOC_MAGIC, 13, struct sync_sched)
+#define SYNC_IOC_GET_SCHED              _IOR(SYNC_IOC_MAGIC, 14, struct sync_sched)
+
+/*
+   Broadcast: every open file gets every token written after it opened,
+   instead of each token going to one reader.  The tokens live in a single
+   ring and each file has its own cursor into it; a slot is reused once
+   every cursor has passed it.
+
+   Switching needs the only opener of an unmapped, empty queue and cannot
+   be undone.  Lanes and mmap are not available on a broadcast queue.  The
+   slowest reader makes the queue full, and the policy decides what that
+   means: BLOCK and EAGAIN wait for it, DROP loses the new token and
+   OVERWRITE skips every reader that is a whole ring behind ahead, which
+   shows up in its skipped count.
+   */
+#define SYNC_IOC_SET_BROADCAST          _IO(SYNC_IOC_MAGIC, 15)
+
+//How far behind this open file is, broadcast queues only
+struct sync_lag
+{
+    __u64 lag;          //Published tokens not read yet
+    __u64 skipped;      //Tokens skipped by SYNC_POLICY_OVERWRITE
+    __u64 stalls;       //Times a writer found the queue full because of us
+};
+
+#define SYNC_IOC_GET_LAG                _IOR(SYNC_IOC_MAGIC, 16, struct sync_lag)
+
+/*
+   io_uring: IORING_OP_URING_CMD on the fd with cmd_op SYNC_URING_ENQUEUE
+   or SYNC_URING_DEQUEUE and struct sync_uring_cmd in sqe->cmd (it fits a
+   plain 64-byte SQE).  addr points at count entries in the binary encoding
+   of the file, as write() or read() would move them; ASCII files move bare
+   tokens.  cqe->res is the number of tokens moved or -errno, with the same
+   short count rules as write() and read().
+
+   A command that has to wait for tokens or room ties up an io_uring worker
+   while it sleeps.  With SYNC_URING_NOWAIT it completes with 0 tokens
+   instead, and the caller can wait in poll() before resubmitting.  The
+   first attempt never sleeps, so an enqueue that fills the queue part way
+   through completes short even without the flag; resubmit the rest.
+   */
+#define SYNC_URING_NOWAIT               (1U << 0)
+
+struct sync_uring_cmd
+{
+    __u64 addr;
+    __u32 count;
+    __u32 flags;        //SYNC_URING_*
+};
+
+#define SYNC_URING_ENQUEUE              _IOW(SYNC_IOC_MAGIC, 17, struct sync_uring_cmd)
+#define SYNC_URING_DEQUEUE              _IOR(SYNC_IOC_MAGIC, 18, struct sync_uring_cmd)
+
+#endif
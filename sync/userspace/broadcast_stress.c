@@ -0,0 +1,191 @@
+//broadcast_stress.c
+//#make -C .. userspace && ./broadcast_stress -p 2 -r 4 -n 1000000
+//
+//Multi-threaded correctness test of broadcast.h in user space.
+//
+//  -p N   producer threads
+//  -r N   readers, each one thread with a cursor of its own
+//  -n N   tokens per producer
+//  -s N   ring capacity
+//  -k     skip ahead instead of waiting for the slowest reader
+//
+//Every reader must see every producer's tokens in increasing order.
+//Without -k it must see all of them, exactly once; with -k it may miss
+//some, but exactly as many as its skipped counter says.
+//
+//Tokens are numbered as they are published.  Numbers must go up for every
+//reader, and without -k each reader must see every one of them.
+
+#include "kshim.h"
+#include "../broadcast.h"
+
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define PRODUCER_SHIFT 40
+
+static struct Broadcast b;
+static struct BroadcastReader readers[MAX_THREADS];
+static atomic64_t seqno;
+
+static int producers = 2, nreaders = 4, skip_ahead = 0;
+static long tokens = 200000;
+static u32 capacity = 128;
+
+static long done_producers;
+static int failed;
+
+static void fail(const char* what, int reader, long producer, long seq)
+{
+	printf("FAIL: %s, reader %d producer %ld token %ld\n", what, reader, producer, seq);
+	__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void* producer_thread(void* data)
+{
+	long p = (long)data, i;
+
+	for (i = 1; i <= tokens && !failed; i++)
+	{
+		while (Broadcast_Publish(&b, (p << PRODUCER_SHIFT) | i, ktime_get_ns(), &seqno, skip_ahead))
+		{
+			sched_yield();
+		}
+	}
+
+	__atomic_fetch_add(&done_producers, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void* reader_thread(void* data)
+{
+	int r = (int)(long)data;
+	struct BroadcastReader* reader = &readers[r];
+	long last[MAX_THREADS] = { 0 };
+	long got = 0, value, p, seq;
+	int done;
+	u64 enqueued, n, last_n = 0;
+
+	for (;;)
+	{
+		done = __atomic_load_n(&done_producers, __ATOMIC_ACQUIRE) == producers;
+
+		if (Broadcast_Read(&b, reader, &value, &enqueued, &n))
+		{
+			if (done || failed)
+			{
+				break;
+			}
+			sched_yield();
+			continue;
+		}
+
+		p = value >> PRODUCER_SHIFT;
+		seq = value & ((1L << PRODUCER_SHIFT) - 1);
+
+		if (p >= producers || seq < 1 || seq > tokens)
+		{
+			fail("garbage", r, p, seq);
+			break;
+		}
+
+		if (seq <= last[p])
+		{
+			fail("out of order or duplicate", r, p, seq);
+			break;
+		}
+
+		if (!skip_ahead && seq != last[p] + 1)
+		{
+			fail("lost", r, p, last[p] + 1);
+			break;
+		}
+
+		if (n <= last_n || (!skip_ahead && n != last_n + 1))
+		{
+			fail("seqno out of order or missing", r, p, seq);
+			break;
+		}
+
+		last[p] = seq;
+		last_n = n;
+		got++;
+	}
+
+	if (!failed && got + (long)reader->skipped != producers * tokens)
+	{
+		printf("FAIL: reader %d got %ld skipped %llu of %ld\n", r, got, reader->skipped, producers * tokens);
+		__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char** argv)
+{
+	pthread_t threads[2 * MAX_THREADS];
+	u64 skipped = 0;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "p:r:n:s:k")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': producers = atoi(optarg); break;
+			case 'r': nreaders = atoi(optarg); break;
+			case 'n': tokens = atol(optarg); break;
+			case 's': capacity = atoi(optarg); break;
+			case 'k': skip_ahead = 1; break;
+			default:
+				printf("usage: %s [-p producers] [-r readers] [-n tokens] [-s capacity] [-k]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (producers < 1 || producers > MAX_THREADS || nreaders < 1 || nreaders > MAX_THREADS ||
+		tokens < 1 || capacity < 2)
+	{
+		printf("1 to %d producers and readers, at least one token, capacity 2 or more.\n", MAX_THREADS);
+		return 2;
+	}
+
+	if (Broadcast_Create(&b, capacity))
+	{
+		printf("FAIL: create\n");
+		return 1;
+	}
+
+	//Everybody joins before the first token, so everybody is owed all of them
+	for (i = 0; i < nreaders; i++)
+	{
+		Broadcast_Join(&b, &readers[i]);
+	}
+
+	for (i = 0; i < nreaders; i++)
+	{
+		pthread_create(&threads[producers + i], NULL, reader_thread, (void*)(long)i);
+	}
+	for (i = 0; i < producers; i++)
+	{
+		pthread_create(&threads[i], NULL, producer_thread, (void*)(long)i);
+	}
+
+	for (i = 0; i < producers + nreaders; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < nreaders; i++)
+	{
+		skipped += readers[i].skipped;
+		Broadcast_Leave(&b, &readers[i]);
+	}
+
+	printf("%s: %d producers %d readers %ld tokens capacity %u%s, %llu skipped\n", failed ? "FAIL" : "ok",
+		producers, nreaders, producers * tokens, b.capacity, skip_ahead ? " skip ahead" : "", skipped);
+
+	Broadcast_Destroy(&b);
+
+	return failed;
+}
@@ -0,0 +1,178 @@
+/*
+Kernel API shim for building rbuffer.h in user space
+
+Just enough of the kernel for rbuffer.h and broadcast.h: fixed width
+types, READ_ONCE and friends on top of the GCC __atomic builtins,
+cmpxchg, the allocators, spinlocks, lists and a per-CPU emulation.
+The stub headers in linux/ all include this file, so both headers
+compile unchanged with -Iuserspace.
+
+get_cpu_ptr() stands in for "preemption off": it takes a lock per
+emulated CPU, so a thread preempted in the middle of a single-producer
+push cannot be overtaken by another thread scheduled on the same CPU.
+*/
+
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef long long s64;
+
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+#define __percpu
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+//Returns the old value like the kernel one, and is a full barrier either way
+#define cmpxchg(p, o, n) ({ \
+	__typeof__(*(p)) __old = (o); \
+	__atomic_compare_exchange_n((p), &__old, (n), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+	__old; })
+
+typedef struct { s64 counter; } atomic64_t;
+
+#define atomic64_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic64_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic64_inc_return(v) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+
+#define min_t(t, a, b) ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+
+#define printk printf
+
+#define PAGE_SIZE 4096UL
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+#define GFP_KERNEL 0
+#define NUMA_NO_NODE (-1)
+
+//Page aligned and zeroed like vmalloc_user(), slots must start zeroed
+static inline void* vmalloc_user(size_t size)
+{
+	void* p;
+
+	if (posix_memalign(&p, PAGE_SIZE, size))
+	{
+		return NULL;
+	}
+
+	return memset(p, 0, size);
+}
+
+#define vfree free
+#define kvzalloc_node(size, gfp, node) vmalloc_user(size)
+#define kvfree free
+#define kvcalloc(n, size, gfp) vmalloc_user((n) * (size))
+
+static inline u32 roundup_pow_of_two(u32 v)
+{
+	u32 r = 1;
+
+	while (r < v)
+	{
+		r <<= 1;
+	}
+
+	return r;
+}
+
+typedef pthread_spinlock_t spinlock_t;
+
+#define spin_lock_init(l) pthread_spin_init((l), PTHREAD_PROCESS_PRIVATE)
+#define spin_lock pthread_spin_lock
+#define spin_unlock pthread_spin_unlock
+
+struct list_head
+{
+	struct list_head* next;
+	struct list_head* prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head* head)
+{
+	head->next = head->prev = head;
+}
+
+static inline void list_add_tail(struct list_head* node, struct list_head* head)
+{
+	node->prev = head->prev;
+	node->next = head;
+	head->prev->next = node;
+	head->prev = node;
+}
+
+static inline void list_del(struct list_head* node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+}
+
+#define list_entry(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+#define list_for_each_entry(pos, head, member) \
+	for (pos = list_entry((head)->next, __typeof__(*pos), member); \
+		&pos->member != (head); \
+		pos = list_entry(pos->member.next, __typeof__(*pos), member))
+
+static inline u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+//Per-CPU emulation: a fixed number of "CPUs", threads map onto them by sched_getcpu()
+#define KSHIM_NR_CPUS 64
+
+#define alloc_percpu(type) ((type*)calloc(KSHIM_NR_CPUS, sizeof(type)))
+#define free_percpu free
+#define per_cpu_ptr(p, cpu) (&(p)[cpu])
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < KSHIM_NR_CPUS; (cpu)++)
+#define cpu_to_node(cpu) 0
+
+static inline int raw_smp_processor_id(void)
+{
+	int cpu = sched_getcpu();
+
+	return (cpu < 0 ? 0 : cpu) % KSHIM_NR_CPUS;
+}
+
+static pthread_mutex_t kshim_cpu_lock[KSHIM_NR_CPUS] =
+{
+	[0 ... KSHIM_NR_CPUS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static __thread int kshim_cpu;
+
+static inline int kshim_get_cpu(void)
+{
+	kshim_cpu = raw_smp_processor_id();
+	pthread_mutex_lock(&kshim_cpu_lock[kshim_cpu]);
+
+	return kshim_cpu;
+}
+
+#define get_cpu_ptr(p) per_cpu_ptr(p, kshim_get_cpu())
+#define put_cpu_ptr(p) pthread_mutex_unlock(&kshim_cpu_lock[kshim_cpu])
+
+#endif
@@ -0,0 +1,155 @@
+//rbuffer_bench.c
+//#make -C .. userspace && ./rbuffer_bench -t 8
+//
+//ns per token through rbuffer.h for 1, 2, 4 .. -t producer/consumer pairs.
+//
+//  -t N   largest thread pair count
+//  -n N   tokens per producer
+//  -s N   ring capacity
+//  -P     per-CPU rings in front of the shared one
+//  -m     mappable shared ring
+//
+//A token costs one insert plus one remove.  ns/op is wall clock time over
+//all tokens moved, so it goes down as long as more threads add throughput.
+
+#include "kshim.h"
+#include "../rbuffer.h"
+
+#include <unistd.h>
+
+static struct RBufferQueue q;
+
+static long tokens = 1000000;
+static u32 capacity = 1024;
+static int percpu = 0, mappable = 0;
+
+static int pairs;
+static long consumed;
+static volatile int go;
+
+static void* producer_thread(void* data)
+{
+	long i;
+
+	while (!go)
+	{
+		;
+	}
+
+	for (i = 1; i <= tokens; i++)
+	{
+		while (RBuffer_Insert(&q, i))
+		{
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static void* consumer_thread(void* data)
+{
+	struct RBufferToken token;
+
+	while (!go)
+	{
+		;
+	}
+
+	while (__atomic_load_n(&consumed, __ATOMIC_RELAXED) < pairs * tokens)
+	{
+		if (RBuffer_TryRemove(&q, &token) == 0)
+		{
+			__atomic_fetch_add(&consumed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+//Insert/remove pairs from one thread, the uncontended cost
+static double single(void)
+{
+	struct RBufferToken token;
+	u64 start;
+	long i;
+
+	start = ktime_get_ns();
+	for (i = 1; i <= tokens; i++)
+	{
+		RBuffer_Insert(&q, i);
+		RBuffer_TryRemove(&q, &token);
+	}
+
+	return (double)(ktime_get_ns() - start) / tokens;
+}
+
+static double run(int n)
+{
+	pthread_t threads[2 * n];
+	u64 start;
+	int i;
+
+	pairs = n;
+	consumed = 0;
+	go = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		pthread_create(&threads[i], NULL, producer_thread, NULL);
+		pthread_create(&threads[n + i], NULL, consumer_thread, NULL);
+	}
+
+	start = ktime_get_ns();
+	go = 1;
+
+	for (i = 0; i < 2 * n; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	return (double)(ktime_get_ns() - start) / (n * tokens);
+}
+
+int main(int argc, char** argv)
+{
+	int opt, n, max_pairs = 4;
+	double ns;
+
+	while ((opt = getopt(argc, argv, "t:n:s:Pm")) != -1)
+	{
+		switch (opt)
+		{
+			case 't': max_pairs = atoi(optarg); break;
+			case 'n': tokens = atol(optarg); break;
+			case 's': capacity = atoi(optarg); break;
+			case 'P': percpu = 1; break;
+			case 'm': mappable = 1; break;
+			default:
+				printf("usage: %s [-t pairs] [-n tokens] [-s capacity] [-P] [-m]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (max_pairs < 1 || tokens < 1 || RBuffer_Create(&q, capacity, percpu, mappable))
+	{
+		printf("Bad arguments.\n");
+		return 2;
+	}
+
+	printf("capacity %u%s%s, %ld tokens per producer\n", q.shared.capacity,
+		percpu ? " percpu" : "", mappable ? " mappable" : "", tokens);
+
+	ns = single();
+	printf("single thread:  %8.1f ns/op %8.2f Mops/s\n", ns, 1e3 / ns);
+
+	for (n = 1; n <= max_pairs; n *= 2)
+	{
+		ns = run(n);
+		printf("%3d x %-3d      %8.1f ns/op %8.2f Mops/s\n", n, n, ns, 1e3 / ns);
+	}
+
+	RBuffer_Destroy(&q);
+
+	return 0;
+}
@@ -0,0 +1,273 @@
+//rbuffer_stress.c
+//#make -C .. userspace && ./rbuffer_stress -p 4 -c 4 -n 1000000
+//
+//Multi-threaded correctness test of rbuffer.h in user space.
+//
+//  -p N / -c N  producer / consumer threads
+//  -n N         tokens per producer
+//  -s N         ring capacity
+//  -P           per-CPU rings in front of the shared one
+//  -m           mappable shared ring (the vmalloc_user() layout)
+//
+//Every token encodes its producer and a sequence number.  At the end
+//every token must have come out exactly once.  Without -P each consumer
+//must also see every producer's tokens in increasing order: a producer
+//inserts in order and a consumer removes in ring position order.  With -P
+//a producer moves between CPU rings, so only loss and duplication are
+//checked.
+//
+//The queue also numbers tokens as they go in; every number from 1 up to
+//the token count must come out exactly once as well.
+
+#include "kshim.h"
+#include "../rbuffer.h"
+
+#include <unistd.h>
+
+#define MAX_THREADS 64
+#define PRODUCER_SHIFT 40
+
+static struct RBufferQueue q;
+
+static int producers = 4, consumers = 4, percpu = 0, mappable = 0;
+static long tokens = 1000000;
+static u32 capacity = 128;
+
+static unsigned char* seen[MAX_THREADS];   //Times each token came out, per producer
+static unsigned char* numbered;             //Times each seqno came out
+static atomic64_t seqno;
+static long consumed;
+static int failed;
+
+static void fail(const char* what, long producer, long seq)
+{
+	printf("FAIL: %s, producer %ld token %ld\n", what, producer, seq);
+	__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void* producer_thread(void* data)
+{
+	long p = (long)data, i;
+
+	for (i = 1; i <= tokens && !failed; i++)
+	{
+		while (RBuffer_Insert(&q, (p << PRODUCER_SHIFT) | i))
+		{
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static void* consumer_thread(void* data)
+{
+	long last[MAX_THREADS] = { 0 };
+	struct RBufferToken token;
+	long p, seq;
+
+	while (__atomic_load_n(&consumed, __ATOMIC_RELAXED) < producers * tokens && !failed)
+	{
+		if (RBuffer_TryRemove(&q, &token))
+		{
+			sched_yield();
+			continue;
+		}
+
+		p = token.value >> PRODUCER_SHIFT;
+		seq = token.value & ((1L << PRODUCER_SHIFT) - 1);
+
+		if (p >= producers || seq < 1 || seq > tokens)
+		{
+			fail("garbage", p, seq);
+			break;
+		}
+
+		if (__atomic_fetch_add(&seen[p][seq], 1, __ATOMIC_RELAXED))
+		{
+			fail("duplicate", p, seq);
+		}
+
+		if (token.seqno < 1 || token.seqno > (u64)(producers * tokens))
+		{
+			fail("bad seqno", p, seq);
+			break;
+		}
+		if (__atomic_fetch_add(&numbered[token.seqno], 1, __ATOMIC_RELAXED))
+		{
+			fail("duplicate seqno", p, seq);
+		}
+
+		if (!percpu && seq <= last[p])
+		{
+			fail("out of order", p, seq);
+		}
+		last[p] = seq;
+
+		__atomic_fetch_add(&consumed, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+//Single threaded edge cases: full, empty, wrap around and overwrite
+static int basic(void)
+{
+	struct RBufferToken token;
+	u32 i, cap;
+
+	if (RBuffer_Create(&q, capacity, percpu, mappable))
+	{
+		printf("FAIL: create\n");
+		return 1;
+	}
+	cap = q.shared.capacity;
+
+	//Go around a few times so positions wrap the mask
+	for (i = 1; i <= 4 * cap; i++)
+	{
+		if (RBuffer_Insert(&q, i) || RBuffer_TryRemove(&q, &token) || token.value != i)
+		{
+			printf("FAIL: wrap at %u\n", i);
+			return 1;
+		}
+	}
+
+	if (!RBuffer_IsEmpty(&q) || RBuffer_TryRemove(&q, &token) == 0)
+	{
+		printf("FAIL: not empty\n");
+		return 1;
+	}
+
+	if (!percpu)
+	{
+		for (i = 1; i <= cap; i++)
+		{
+			if (RBuffer_Insert(&q, i))
+			{
+				printf("FAIL: full after %u of %u\n", i - 1, cap);
+				return 1;
+			}
+		}
+
+		if (RBuffer_Insert(&q, cap + 1) == 0 || !RBuffer_IsFull(&q) || RBuffer_Size(&q) != (int)cap)
+		{
+			printf("FAIL: not full at capacity\n");
+			return 1;
+		}
+
+		token.value = cap + 1;
+		token.enqueued = ktime_get_ns();
+		token.seqno = 0;
+		if (RBuffer_InsertOverwrite(&q, &token) != 1 || RBuffer_Remove(&q) != 2)
+		{
+			printf("FAIL: overwrite did not drop the oldest\n");
+			return 1;
+		}
+	}
+
+	RBuffer_Destroy(&q);
+
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	pthread_t threads[2 * MAX_THREADS];
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "p:c:n:s:Pm")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': producers = atoi(optarg); break;
+			case 'c': consumers = atoi(optarg); break;
+			case 'n': tokens = atol(optarg); break;
+			case 's': capacity = atoi(optarg); break;
+			case 'P': percpu = 1; break;
+			case 'm': mappable = 1; break;
+			default:
+				printf("usage: %s [-p producers] [-c consumers] [-n tokens] [-s capacity] [-P] [-m]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	if (producers < 1 || producers > MAX_THREADS || consumers < 1 || consumers > MAX_THREADS || tokens < 1)
+	{
+		printf("1 to %d producers and consumers, at least one token.\n", MAX_THREADS);
+		return 2;
+	}
+
+	if (basic())
+	{
+		return 1;
+	}
+
+	if (RBuffer_Create(&q, capacity, percpu, mappable))
+	{
+		printf("FAIL: create\n");
+		return 1;
+	}
+
+	for (i = 0; i < producers; i++)
+	{
+		seen[i] = calloc(tokens + 1, 1);
+	}
+	numbered = calloc(producers * tokens + 1, 1);
+	q.seqno = &seqno;
+
+	for (i = 0; i < consumers; i++)
+	{
+		pthread_create(&threads[producers + i], NULL, consumer_thread, NULL);
+	}
+	for (i = 0; i < producers; i++)
+	{
+		pthread_create(&threads[i], NULL, producer_thread, (void*)(long)i);
+	}
+
+	for (i = 0; i < producers + consumers; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < producers && !failed; i++)
+	{
+		long seq;
+
+		for (seq = 1; seq <= tokens; seq++)
+		{
+			if (seen[i][seq] != 1)
+			{
+				fail("lost", i, seq);
+				break;
+			}
+		}
+	}
+
+	for (i = 1; i <= producers * tokens && !failed; i++)
+	{
+		if (numbered[i] != 1)
+		{
+			fail("lost seqno", -1, i);
+		}
+	}
+
+	if (!failed && RBuffer_Size(&q) != 0)
+	{
+		printf("FAIL: %d tokens left over\n", RBuffer_Size(&q));
+		failed = 1;
+	}
+
+	printf("%s: %d producers %d consumers %ld tokens capacity %u%s%s\n", failed ? "FAIL" : "ok",
+		producers, consumers, producers * tokens, q.shared.capacity,
+		percpu ? " percpu" : "", mappable ? " mappable" : "");
+
+	RBuffer_Destroy(&q);
+	for (i = 0; i < producers; i++)
+	{
+		free(seen[i]);
+	}
+	free(numbered);
+
+	return failed;
+}